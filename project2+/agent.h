@@ -11,13 +11,29 @@
 #include <string>
 #include <random>
 #include <sstream>
+#include <iomanip>
 #include <map>
 #include <type_traits>
 #include <algorithm>
 #include <fstream>
+#include <cstdio>
+#include <chrono>
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "board.h"
+#include "bitboard.h"
 #include "action.h"
 #include "weight.h"
+#include "pattern.h"
+#include "transposition.h"
+#include "pool.h"
+#include "replay.h"
+#if defined(PROFILE_NETWORK)
+#include "profile.h"
+#endif
 
 class agent {
 public:
@@ -35,6 +51,12 @@ public:
 	virtual action take_action(const board& b) { return action(); }
 	virtual bool check_for_win(const board& b) { return false; }
 
+	/**
+	 * the internal states to be checkpointed, e.g., random engines, so that a resumed run continues exactly
+	 */
+	virtual void save_state(std::ostream& out) const {}
+	virtual void load_state(std::istream& in) {}
+
 public:
 	virtual std::string property(const std::string& key) const { return meta.at(key); }
 	virtual void notify(const std::string& msg) { meta[msg.substr(0, msg.find('='))] = { msg.substr(msg.find('=') + 1) }; }
@@ -63,6 +85,9 @@ public:
 	}
 	virtual ~random_agent() {}
 
+	virtual void save_state(std::ostream& out) const { out << engine << std::endl; }
+	virtual void load_state(std::istream& in) { in >> std::ws >> engine; } // the engine does not skip whitespaces
+
 protected:
 	std::default_random_engine engine;
 };
@@ -73,68 +98,432 @@ protected:
 class weight_agent : public agent {
 public:
 	weight_agent(const std::string& args = "") : agent(args), alpha(0) {
-		std::string tuple4 = "65536,65536,65536,65536,65536,65536,65536,65536";
-		std::string tuple6 = "16777216,16777216,16777216,16777216";
-		meta["init"] = { tuple6 };
-		if (meta.find("init") != meta.end())
-			init_weights(meta["init"]);
-		if (meta.find("load") != meta.end())
-			load_weights(meta["load"]);
 		if (meta.find("alpha") != meta.end())
 			alpha = float(meta["alpha"]);
+		if (meta.find("alloc") != meta.end() || meta.find("numa") != meta.end())
+			allocation::policy().configure(meta["alloc"], meta["numa"]);
+		if (meta.find("load") != meta.end())
+			load_weights(meta["load"]);
+		else if (meta.find("init") != meta.end())
+			init_weights(meta["init"]);
+		if (meta.find("tc") != meta.end() && property("tc") != "0" && alpha != 0)
+			init_coherence();
+		else
+			release_coherence();
+		if (meta.find("quant") != meta.end() && alpha == 0)
+			quantize_weights(int(meta["quant"]));
+		if (net.empty() && (qnet16.size() || qnet8.size()) && alpha != 0)
+			std::exit(-1); // quantized tables are for play-only mode
+	}
+	/**
+	 * replica viewing the tables of another agent, e.g., for Hogwild training where all threads update the same tables without locks
+	 * the tables are saved only by the original agent
+	 */
+	weight_agent(weight_agent& shared) : agent(shared), alpha(shared.alpha) {
+		if (shared.hnet.size())
+			std::exit(-1); // hashed tables are rehashed when materializing entries, and cannot be shared by threads
+		meta.erase("save");
+		std::shared_ptr<void> region(&shared, [](void*) {}); // the original agent outlives its replicas
+		for (weight& w : shared.net)
+			net.emplace_back(w.data(), w.size(), region);
+		for (qweight<int16_t>& w : shared.qnet16)
+			qnet16.emplace_back(const_cast<int16_t*>(w.data()), w.size(), w.factor(), region);
+		for (qweight<int8_t>& w : shared.qnet8)
+			qnet8.emplace_back(const_cast<int8_t*>(w.data()), w.size(), w.factor(), region);
+		for (weight& w : shared.error)
+			error.emplace_back(w.data(), w.size(), region);
+		for (weight& w : shared.abserror)
+			abserror.emplace_back(w.data(), w.size(), region);
 	}
 	virtual ~weight_agent() {
 		if (meta.find("save") != meta.end())
 			save_weights(meta["save"]);
 	}
 
+	virtual void save_state(std::ostream& out) const { out << std::setprecision(9) << alpha << std::endl; }
+	virtual void load_state(std::istream& in) { in >> alpha; }
+
+	/**
+	 * whether the tables are hashed, which are neither shared by threads nor checkpointed
+	 */
+	bool hashed() const { return hnet.size(); }
+	/**
+	 * the float tables to be checkpointed, i.e., the weights followed by the accumulators of TC learning if enabled
+	 */
+	std::vector<weight*> tables() {
+		if (hnet.size()) std::exit(-1); // hashed tables are saved as weight files only
+		std::vector<weight*> res;
+		for (std::vector<weight>* group : { &net, &error, &abserror })
+			for (weight& w : *group) res.push_back(&w);
+		return res;
+	}
+
 protected:
 	virtual void init_weights(const std::string& info) {
 		std::string res = info; // comma-separated sizes, e.g., "65536,65536"
 		for (char& ch : res)
 			if (!std::isdigit(ch)) ch = ' ';
 		std::stringstream in(res);
-		for (size_t size; in >> size; net.emplace_back(size));
+		std::vector<size_t> sizes;
+		for (size_t size; in >> size; sizes.push_back(size));
+		if (meta.find("hash") != meta.end()) {
+			for (size_t size : sizes) hnet.emplace_back(size, hash_capacity(sizes.size()));
+		} else {
+			for (size_t size : sizes) net.emplace_back(size);
+		}
+	}
+	/**
+	 * the slots of each hashed table, i.e., the memory cap "hash" (in MB) divided evenly among the tables
+	 */
+	size_t hash_capacity(size_t tables) {
+		return (size_t(meta["hash"]) << 20) / std::max<size_t>(tables, 1) / sizeof(hash_weight::slot);
 	}
+	/**
+	 * the accumulated errors and absolute errors of temporal coherence (TC) learning,
+	 * i.e., each entry is adjusted with its own learning rate alpha * |error| / abserror
+	 */
+	virtual void init_coherence() {
+		if (hnet.size()) {
+			std::cerr << "tc is not supported with hashed tables (hash)" << std::endl;
+			std::exit(-1); // TC learning needs dense tables
+		}
+		if (error.size() == net.size() && abserror.size() == net.size()) return; // loaded with the weights
+		error.clear();
+		abserror.clear();
+		for (weight& w : net) {
+			error.emplace_back(w.size());
+			abserror.emplace_back(w.size());
+		}
+	}
+	virtual void release_coherence() {
+		std::vector<weight>().swap(error);
+		std::vector<weight>().swap(abserror);
+	}
+	/**
+	 * convert the float tables into 16-bit or 8-bit tables with per-table scales,
+	 * the float tables are released afterward
+	 */
+	virtual void quantize_weights(unsigned bits) {
+		switch (bits) {
+		case 16: qnet16.assign(net.begin(), net.end()); break;
+		case 8: qnet8.assign(net.begin(), net.end()); break;
+		default: return;
+		}
+		std::vector<weight>().swap(net);
+	}
+	/**
+	 * the high byte of the table count indicates the element type,
+	 * i.e., 0 for float tables, 16 or 8 for quantized tables,
+	 * or 1 for float tables followed by the accumulators of TC learning,
+	 * 2 or 3 for the block-sparse encoding of 0 or 1, respectively, and 4 for hashed tables
+	 * files starting with the signature of weight_header are memory-mapped instead
+	 */
 	virtual void load_weights(const std::string& path) {
 		std::ifstream in(path, std::ios::in | std::ios::binary);
 		if (!in.is_open()) std::exit(-1);
 		uint32_t size;
 		in.read(reinterpret_cast<char*>(&size), sizeof(size));
-		net.resize(size);
-		for (weight& w : net) in >> w;
+		if (size == weight_header::magic()) {
+			in.close();
+			map_weights(path);
+			return;
+		}
+		switch (size >> 24) {
+		case 0:
+			net.resize(size);
+			for (weight& w : net) in >> w;
+			break;
+		case 1:
+			net.resize(size & 0xffffffu);
+			error.resize(net.size());
+			abserror.resize(net.size());
+			for (weight& w : net) in >> w;
+			for (weight& w : error) in >> w;
+			for (weight& w : abserror) in >> w;
+			break;
+		case 2:
+		case 3:
+			read_sparse(in, net, size & 0xffffffu);
+			if ((size >> 24) == 3) {
+				read_sparse(in, error, net.size());
+				read_sparse(in, abserror, net.size());
+			}
+			break;
+		case 4:
+			std::vector<weight>().swap(net);
+			hnet.clear();
+			for (size_t k = 0; k < (size & 0xffffffu); k++) {
+				if (meta.find("hash") != meta.end()) hnet.emplace_back(0, hash_capacity(size & 0xffffffu));
+				else hnet.emplace_back();
+				in >> hnet.back();
+			}
+			break;
+		case 16:
+			std::vector<weight>().swap(net);
+			qnet16.resize(size & 0xffffffu);
+			for (qweight<int16_t>& w : qnet16) in >> w;
+			break;
+		case 8:
+			std::vector<weight>().swap(net);
+			qnet8.resize(size & 0xffffffu);
+			for (qweight<int8_t>& w : qnet8) in >> w;
+			break;
+		default:
+			std::exit(-1);
+		}
 		in.close();
 	}
+	/**
+	 * the weights are written to a temporary file and then renamed,
+	 * so that a weight file mapped by this or other processes is never truncated
+	 */
 	virtual void save_weights(const std::string& path) {
-		std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+		std::ofstream out(path + ".tmp", std::ios::out | std::ios::binary | std::ios::trunc);
 		if (!out.is_open()) std::exit(-1);
-		uint32_t size = net.size();
-		out.write(reinterpret_cast<char*>(&size), sizeof(size));
-		for (weight& w : net) out << w;
+		if (hnet.size()) {
+			uint32_t size = hnet.size() | (4u << 24);
+			out.write(reinterpret_cast<char*>(&size), sizeof(size));
+			for (hash_weight& w : hnet) out << w;
+		} else if (meta.find("format") != meta.end() && property("format") == "mmap") {
+			if (qnet16.size()) write_mapped(out, qnet16, 16);
+			else if (qnet8.size()) write_mapped(out, qnet8, 8);
+			else write_mapped(out, net, 0);
+		} else if (meta.find("format") != meta.end() && property("format") == "sparse" && net.size()) {
+			bool tc = meta.find("tc") != meta.end() && property("tc") == "save" && error.size();
+			uint32_t size = net.size() | ((tc ? 3u : 2u) << 24);
+			out.write(reinterpret_cast<char*>(&size), sizeof(size));
+			write_sparse(out, net);
+			if (tc) {
+				write_sparse(out, error);
+				write_sparse(out, abserror);
+			}
+		} else if (qnet16.size()) {
+			uint32_t size = qnet16.size() | (16u << 24);
+			out.write(reinterpret_cast<char*>(&size), sizeof(size));
+			for (qweight<int16_t>& w : qnet16) out << w;
+		} else if (qnet8.size()) {
+			uint32_t size = qnet8.size() | (8u << 24);
+			out.write(reinterpret_cast<char*>(&size), sizeof(size));
+			for (qweight<int8_t>& w : qnet8) out << w;
+		} else if (meta.find("tc") != meta.end() && property("tc") == "save" && error.size()) {
+			uint32_t size = net.size() | (1u << 24);
+			out.write(reinterpret_cast<char*>(&size), sizeof(size));
+			for (weight& w : net) out << w;
+			for (weight& w : error) out << w;
+			for (weight& w : abserror) out << w;
+		} else {
+			uint32_t size = net.size();
+			out.write(reinterpret_cast<char*>(&size), sizeof(size));
+			for (weight& w : net) out << w;
+		}
 		out.close();
+		if (!out || std::rename((path + ".tmp").c_str(), path.c_str()) != 0) std::exit(-1);
+	}
+
+	/**
+	 * view the tables directly from a private mapping of the weight file,
+	 * which is read-only in play-only mode, or copy-on-write if the tables are trained
+	 */
+	virtual void map_weights(const std::string& path) {
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd == -1) std::exit(-1);
+		struct stat st;
+		if (fstat(fd, &st) == -1 || size_t(st.st_size) < sizeof(weight_header)) std::exit(-1);
+		size_t length = st.st_size;
+		void* addr = mmap(nullptr, length, alpha == 0 ? PROT_READ : PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (addr == MAP_FAILED) std::exit(-1);
+		std::shared_ptr<void> region(addr, [length](void* p) { munmap(p, length); });
+
+		char* base = static_cast<char*>(addr);
+		const weight_header& head = *reinterpret_cast<const weight_header*>(base);
+		const weight_header::entry* entry = reinterpret_cast<const weight_header::entry*>(base + sizeof(weight_header));
+		if (head.version != 1 || head.align == 0 || sizeof(weight_header) + head.count * sizeof(weight_header::entry) > length) std::exit(-1);
+		std::vector<weight>().swap(net);
+		qnet16.clear();
+		qnet8.clear();
+		for (uint32_t i = 0; i < head.count; i++) {
+			const weight_header::entry& e = entry[i];
+			if (e.offset % head.align || e.offset + e.size * (head.element ? head.element / 8 : sizeof(weight::type)) > length) std::exit(-1);
+			char* data = base + e.offset;
+			switch (head.element) {
+			case 0: net.emplace_back(reinterpret_cast<weight::type*>(data), e.size, region); break;
+			case 16: qnet16.emplace_back(reinterpret_cast<int16_t*>(data), e.size, e.scale, region); break;
+			case 8: qnet8.emplace_back(reinterpret_cast<int8_t*>(data), e.size, e.scale, region); break;
+			default: std::exit(-1);
+			}
+		}
+	}
+	/**
+	 * block-sparse encoding of float tables, where each block of 64 entries has a bitmap of its nonzero entries
+	 * i.e., for each table, the number of entries, the number of nonzero entries, the bitmaps, and then the nonzero entries
+	 */
+	void write_sparse(std::ostream& out, const std::vector<weight>& tables) {
+		for (const weight& w : tables) {
+			std::vector<uint64_t> bitmap((w.size() + 63) / 64);
+			std::vector<weight::type> value;
+			for (size_t i = 0; i < w.size(); i++) {
+				if (w[i] == 0 && !std::signbit(w[i])) continue;
+				bitmap[i / 64] |= uint64_t(1) << (i % 64);
+				value.push_back(w[i]);
+			}
+			uint64_t size = w.size(), count = value.size();
+			out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+			out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+			out.write(reinterpret_cast<const char*>(bitmap.data()), sizeof(uint64_t) * bitmap.size());
+			out.write(reinterpret_cast<const char*>(value.data()), sizeof(weight::type) * value.size());
+		}
+	}
+	/**
+	 * the tables are decoded in chunks of blocks by a worker pool, while the following tables are still being read
+	 * each chunk starts from the prefix count of nonzero entries in the bitmaps
+	 */
+	void read_sparse(std::istream& in, std::vector<weight>& tables, size_t num) {
+		const size_t chunk = 4096; // blocks decoded by one job
+		worker_pool pool(std::max(std::thread::hardware_concurrency(), 1u));
+		worker_pool::group decode;
+		std::vector<std::vector<uint64_t>> bitmaps(num);
+		std::vector<std::vector<weight::type>> values(num);
+		tables.clear();
+		tables.reserve(num); // so that the tables being decoded are never moved
+		for (size_t k = 0; k < num; k++) {
+			uint64_t size = 0, count = 0;
+			in.read(reinterpret_cast<char*>(&size), sizeof(size));
+			in.read(reinterpret_cast<char*>(&count), sizeof(count));
+			if (!in || count > size) std::exit(-1);
+			bitmaps[k].resize((size + 63) / 64);
+			values[k].resize(count);
+			in.read(reinterpret_cast<char*>(bitmaps[k].data()), sizeof(uint64_t) * bitmaps[k].size());
+			in.read(reinterpret_cast<char*>(values[k].data()), sizeof(weight::type) * values[k].size());
+			tables.emplace_back(size);
+			if (!in) std::exit(-1);
+
+			const uint64_t* bitmap = bitmaps[k].data();
+			const weight::type* value = values[k].data();
+			weight::type* entry = tables.back().data();
+			size_t blocks = bitmaps[k].size(), begin = 0;
+			std::vector<size_t> offset;
+			for (size_t b = 0; b < blocks; b++) {
+				if (b % chunk == 0) offset.push_back(begin);
+				begin += __builtin_popcountll(bitmap[b]);
+			}
+			if (begin != count || (size % 64 && bitmap[blocks - 1] >> (size % 64))) std::exit(-1);
+			for (size_t b = 0; b < blocks; b += chunk) {
+				pool.spawn(decode, [=]() {
+					const weight::type* next = value + offset[b / chunk];
+					for (size_t i = b; i < std::min(b + chunk, blocks); i++) {
+						for (uint64_t bits = bitmap[i]; bits; bits &= bits - 1)
+							entry[i * 64 + __builtin_ctzll(bits)] = *(next++);
+					}
+				});
+			}
+		}
+		pool.wait(decode);
+	}
+	template<typename table>
+	void write_mapped(std::ostream& out, const std::vector<table>& tables, uint32_t element) {
+		const uint64_t align = 4096;
+		weight_header head = { weight_header::magic(), 1, uint32_t(tables.size()), element, align, 0 };
+		std::vector<weight_header::entry> entry(tables.size());
+		uint64_t offset = sizeof(weight_header) + sizeof(weight_header::entry) * tables.size();
+		for (size_t i = 0; i < tables.size(); i++) {
+			offset = (offset + align - 1) / align * align;
+			entry[i] = { offset, tables[i].size(), tables[i].factor(), 0 };
+			offset += sizeof(typename table::type) * tables[i].size();
+		}
+		out.write(reinterpret_cast<const char*>(&head), sizeof(head));
+		out.write(reinterpret_cast<const char*>(entry.data()), sizeof(weight_header::entry) * entry.size());
+		for (size_t i = 0; i < tables.size(); i++) {
+			out.seekp(entry[i].offset);
+			out.write(reinterpret_cast<const char*>(tables[i].data()), sizeof(typename table::type) * tables[i].size());
+		}
 	}
 
 protected:
 	std::vector<weight> net;
+	std::vector<hash_weight> hnet; // hashed tables materializing the adjusted entries only, or empty if the tables are dense
+	std::vector<qweight<int16_t>> qnet16;
+	std::vector<qweight<int8_t>> qnet8;
+	std::vector<weight> error; // accumulators of TC learning, or empty if disabled
+	std::vector<weight> abserror;
 	float alpha;
 };
 
-class td_agent : public weight_agent {
+/**
+ * n-tuple networks for td_agent, declared once and shared by evaluation and learning
+ */
+typedef network<8, // 4x6-tuple for eight isomorphic patterns (32 features)
+	pattern<0, 1, 2, 3, 4, 5>,
+	pattern<4, 5, 6, 7, 8, 9>,
+	pattern<0, 1, 2, 4, 5, 6>,
+	pattern<4, 5, 6, 8, 9, 10>> tuple6_network;
+typedef network<1, // 8x4-tuple for rows and columns (8 features)
+	pattern<0, 1, 2, 3>,
+	pattern<4, 5, 6, 7>,
+	pattern<8, 9, 10, 11>,
+	pattern<12, 13, 14, 15>,
+	pattern<0, 4, 8, 12>,
+	pattern<1, 5, 9, 13>,
+	pattern<2, 6, 10, 14>,
+	pattern<3, 7, 11, 15>> tuple4_network;
+typedef network<8, // 4x8-tuple for eight isomorphic patterns (32 features), which needs hashed tables, e.g., hash=16384
+	pattern<0, 1, 2, 3, 4, 5, 6, 7>,
+	pattern<4, 5, 6, 7, 8, 9, 10, 11>,
+	pattern<0, 1, 2, 4, 5, 6, 8, 9>,
+	pattern<4, 5, 6, 8, 9, 10, 12, 13>> tuple8_network;
+
+template<class network>
+class basic_td_agent : public weight_agent {
 public:
-	td_agent(const std::string& args = "") : weight_agent(args), 
-		opcode({ 0, 1, 2, 3 }) {
+	basic_td_agent(const std::string& args = "") : weight_agent(args + " init=" + network::sizes()), // the tables always match the network
+		replayBuffer(1 << 14), opcode({ 0, 1, 2, 3 }), depth(1), budget(0), timeout(false) {
+			if (meta.find("replay") != meta.end())
+				replayBuffer = ring_buffer<step>(int(meta["replay"]));
+			if (meta.find("depth") != meta.end())
+				depth = int(meta["depth"]);
+			if (meta.find("tt") != meta.end() && alpha == 0)
+				tt.resize(int(meta["tt"])); // the searched values go stale once the weights are updated
+			if (meta.find("time") != meta.end()) {
+				budget = float(meta["time"]);
+				if (meta.find("depth") == meta.end()) depth = 255; // the limit of deepening
+			}
+			if (meta.find("threads") != meta.end() && int(meta["threads"]) > 1)
+				pool.reset(new worker_pool(int(meta["threads"])));
+			if (!fits(net) || !fits(hnet) || !fits(qnet16) || !fits(qnet8))
+				std::exit(-1); // the loaded tables do not match the network, e.g., saved by another network
 			spaces[0] = { 12, 13, 14, 15 };
 			spaces[1] = { 0, 4, 8, 12 };
 			spaces[2] = { 0, 1, 2, 3};
 			spaces[3] = { 3, 7, 11, 15 };
 			spaces[4] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+#if defined(PROFILE_NETWORK)
+			profile.reset(new network_profile(network::sizes(), meta.find("profile") != meta.end() ? int(meta["profile"]) : 1000));
+#endif
+		}
+	/**
+	 * replica sharing the tables of another agent, with its own replay buffer and without transposition table or worker pool
+	 */
+	basic_td_agent(basic_td_agent& shared) : weight_agent(shared),
+		replayBuffer(shared.replayBuffer.capacity()), opcode(shared.opcode), depth(shared.depth), budget(shared.budget), timeout(false) {
+			std::copy(shared.spaces, shared.spaces + 5, spaces);
+#if defined(PROFILE_NETWORK)
+			profile = shared.profile; // replicas count into the same profile
+#endif
 		}
+	virtual ~basic_td_agent() {
+		if (!tt.empty()) std::cerr << tt << std::endl;
+#if defined(PROFILE_NETWORK)
+		if (profile.use_count() == 1 && profile->episodes % profile->every != 0) profile->show(profile->episodes);
+#endif
+	}
 
 public:
 	struct step
 	{
 		int reward;
-		board afterstate;
+		float value; // the value of afterstate, refreshed by its latest adjustment
+		bitboard afterstate;
+		uint32_t index[network::features()]; // the feature indices of afterstate, extracted once when played
 	}; // use to store afterstate and reward
 
 public:
@@ -142,168 +531,370 @@ public:
 		int bestOP = -1;
 		int bestReward = -1;
 		float bestValue = -100000;
-		board bestAfterstate;
+		bitboard bestAfterstate;
+		if (!tt.empty()) tt.age();
+		bitboard afterstates[4]; // use to store state after sliding
+		int rewards[4];
+		float values[4];
+		int legal = 0;
 		for(int op : opcode) {
-			board afterstate = before; // use to store state after sliding
-			int reward = afterstate.slide(op);
-			if(reward == -1) continue;
-			//float value = valueEstimate(afterstate);
-			float value = expectationEstimate(afterstate);
-			if(reward + value > bestReward + bestValue){
-				bestReward = reward;
-				bestValue = value;
+			afterstates[op] = before;
+			rewards[op] = afterstates[op].slide(op);
+			if(rewards[op] != -1) legal++;
+		}
+		if (budget == 0) {
+			searchMoves(afterstates, rewards, values, opcode, depth);
+		} else if (legal > 0) {
+			deepenMoves(afterstates, rewards, values, legal);
+		}
+		for(int op : opcode) {
+			if(rewards[op] == -1) continue;
+			if(rewards[op] + values[op] > bestReward + bestValue){
+				bestReward = rewards[op];
+				bestValue = values[op];
 				bestOP = op;
-				bestAfterstate = afterstate;
+				bestAfterstate = afterstates[op];
 			}
 		}
-		if(bestOP != -1){
-			replayBuffer.push_back({bestReward, bestAfterstate});
+		if(bestOP != -1 && alpha != 0){
+			step& last = replayBuffer.push();
+			last.reward = bestReward;
+			last.value = 0;
+			last.afterstate = bestAfterstate;
+			network::extract(bestAfterstate, last.index);
 		}
 		return action::slide(bestOP);
 	}
-	int featureExtract(const board& after, int a, int b, int c, int d, int e, int f) const {
-		//for 8*4-tuple
-		//return after(a) * 16 * 16 * 16 + after(b) * 16 * 16 + after(c) * 16 + after(d);
-		
-		//for 4*6-tuple
-		return after(a) * 16 * 16 * 16 * 16 * 16 + after(b) * 16 * 16 * 16 * 16 + after(c) * 16 * 16 * 16 + after(d) * 16 * 16 + after(e) * 16 + after(f);
-	}
-	float valueEstimate(const board& after) const {
-		float value = 0;
-
-		//for 8*4-tuple
-		/*
-		value += net[0][featureExtract(after, 0, 1, 2, 3)];
-		value += net[1][featureExtract(after, 4, 5, 6, 7)];
-		value += net[2][featureExtract(after, 8, 9, 10, 11)];
-		value += net[3][featureExtract(after, 12, 13, 14, 15)];
-		value += net[4][featureExtract(after, 0, 4, 8, 12)];
-		value += net[5][featureExtract(after, 1, 5, 9, 13)];
-		value += net[6][featureExtract(after, 2, 6, 10, 14)];
-		value += net[7][featureExtract(after, 3, 7, 11, 15)];
-		*/
-
-		//for 4*6-tuple
-		board state = after;
-		for(int r = 0; r < 4; r++) {
-			value += net[0][featureExtract(state, 0, 1, 2, 3, 4, 5)];
-			value += net[1][featureExtract(state, 4, 5, 6, 7, 8, 9)];
-			value += net[2][featureExtract(state, 0, 1, 2, 4, 5, 6)];
-			value += net[3][featureExtract(state, 4, 5, 6, 8, 9, 10)];
-			state.rotate_clockwise();
-		}
-		state.reflect_horizontal();
-		for(int r = 0; r < 4; r++) {
-			value += net[0][featureExtract(state, 0, 1, 2, 3, 4, 5)];
-			value += net[1][featureExtract(state, 4, 5, 6, 7, 8, 9)];
-			value += net[2][featureExtract(state, 0, 1, 2, 4, 5, 6)];
-			value += net[3][featureExtract(state, 4, 5, 6, 8, 9, 10)];
-			state.rotate_clockwise();
+	/**
+	 * search the legal slides in the given order, the root moves are searched in parallel if depth > 1
+	 */
+	void searchMoves(const bitboard afterstates[], const int rewards[], float values[], const std::array<int, 4>& order, unsigned depth) const {
+		worker_pool::group moves;
+		for(int op : order) {
+			if(rewards[op] == -1) continue;
+			auto search = [=]() {
+				if (depth == 0) {
+					values[op] = valueEstimate(afterstates[op]);
+					return;
+				}
+#if defined(PROFILE_NETWORK)
+				network_profile::timer timer(profile->expectation);
+#endif
+				values[op] = expectationEstimate(afterstates[op], depth);
+			};
+			if (pool && depth > 1) pool->spawn(moves, search);
+			else search();
 		}
-
+		if (pool) pool->wait(moves);
+	}
+	/**
+	 * iterative deepening within the time budget, starting from the greedy search (depth 0) which is never aborted
+	 * each iteration searches the root moves in the order of the values from the previous iteration,
+	 * and the values of the last completed iteration are kept if the next one runs out of time
+	 * no new work is started after a fraction of the budget, so that the unwinding of an aborted search stays within the budget
+	 */
+	void deepenMoves(const bitboard afterstates[], const int rewards[], float values[], int legal) {
+		typedef std::chrono::steady_clock clock;
+		clock::time_point start = clock::now();
+		deadline = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(budget * 0.8));
+		timeout = false;
+		searchMoves(afterstates, rewards, values, opcode, 0);
+		if (legal == 1) return; // nothing to choose
+
+		std::array<int, 4> order = opcode;
+		float trial[4];
+		clock::duration last = clock::now() - start;
+		for (unsigned d = 1; d <= depth; d++) {
+			std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+				return (rewards[a] != -1) > (rewards[b] != -1) || (rewards[a] != -1 && rewards[b] != -1 && rewards[a] + values[a] > rewards[b] + values[b]);
+			});
+			clock::time_point begin = clock::now();
+			searchMoves(afterstates, rewards, trial, order, d);
+			if (timeout) break;
+			for(int op : opcode) values[op] = trial[op];
+
+			//Skip the next iteration if it is not expected to complete, assuming the same growth as this one.
+			clock::time_point end = clock::now();
+			clock::duration elapsed = end - begin;
+			double growth = std::max(double(elapsed.count()) / std::max(last.count(), clock::duration::rep(1)), 1.0);
+			if (end + std::chrono::duration_cast<clock::duration>(elapsed * growth) > deadline) break;
+			last = elapsed;
+		}
+	}
+	float valueEstimate(const bitboard& after) const {
+		float value;
+		valueEstimate(&after, &value, 1);
 		return value;
 	}
-	void valueAdjust(const board& after, float TDtarget) {
-		float currentV = valueEstimate(after);
+	/**
+	 * estimate the values of multiple afterstates at once,
+	 * where the lookups of later afterstates are prefetched while earlier ones are accumulated
+	 */
+	void valueEstimate(const bitboard after[], float value[], size_t num) const {
+#if defined(PROFILE_NETWORK)
+		network_profile::timer timer(profile->value, num);
+#endif
+		if (hnet.size()) return pipelineEstimate(hnet.data(), after, value, num);
+		if (qnet16.size()) return pipelineEstimate(qnet16.data(), after, value, num);
+		if (qnet8.size()) return pipelineEstimate(qnet8.data(), after, value, num);
+		return pipelineEstimate(net.data(), after, value, num);
+	}
+	void valueAdjust(const bitboard& after, float TDtarget) {
+		uint32_t index[network::features()];
+		network::extract(after, index);
+		valueAdjust(index, TDtarget);
+	}
+	/**
+	 * adjust the features of an afterstate toward the TD target, and return the adjusted value
+	 * the evaluations before and after the adjustment share the same indices
+	 */
+	float valueAdjust(const uint32_t index[], float TDtarget) {
+		if (hnet.size()) return valueAdjust(hnet.data(), index, TDtarget);
+		return valueAdjust(net.data(), index, TDtarget);
+	}
+	template<typename table>
+	float valueAdjust(table* tables, const uint32_t index[], float TDtarget) {
+		float currentV = network::estimate(tables, index);
 		float TDerror = TDtarget - currentV;
 		float adjustment = alpha * TDerror;
-		
-		//These 8 feature weights are adjusted with the same TD error.
-		/*
-		net[0][featureExtract(after, 0, 1, 2, 3)] += adjustment;
-		net[1][featureExtract(after, 4, 5, 6, 7)] += adjustment;
-		net[2][featureExtract(after, 8, 9, 10, 11)] += adjustment;
-		net[3][featureExtract(after, 12, 13, 14, 15)] += adjustment;
-		net[4][featureExtract(after, 0, 4, 8, 12)] += adjustment;
-		net[5][featureExtract(after, 1, 5, 9, 13)] += adjustment;
-		net[6][featureExtract(after, 2, 6, 10, 14)] += adjustment;
-		net[7][featureExtract(after, 3, 7, 11, 15)] += adjustment;
-		*/
-
-		//These is 4*6-tuple for eight isomorphic patterns.(32 features)
-		board state = after;
-		for(int r = 0; r < 4; r++) {
-			net[0][featureExtract(state, 0, 1, 2, 3, 4, 5)] += adjustment/8;
-			net[1][featureExtract(state, 4, 5, 6, 7, 8, 9)] += adjustment/8;
-			net[2][featureExtract(state, 0, 1, 2, 4, 5, 6)] += adjustment/8;
-			net[3][featureExtract(state, 4, 5, 6, 8, 9, 10)] += adjustment/8;
-			state.rotate_clockwise();
-		}
-		state.reflect_horizontal();
-		for(int r = 0; r < 4; r++) {
-			net[0][featureExtract(state, 0, 1, 2, 3, 4, 5)] += adjustment/8;
-			net[1][featureExtract(state, 4, 5, 6, 7, 8, 9)] += adjustment/8;
-			net[2][featureExtract(state, 0, 1, 2, 4, 5, 6)] += adjustment/8;
-			net[3][featureExtract(state, 4, 5, 6, 8, 9, 10)] += adjustment/8;
-			state.rotate_clockwise();
-		}
-	}
-
-	float expectationEstimate(const board& after) const {
-		float expectation = 0.0;
-		int emptySpace = 0;
 
-		std::vector<int> space = spaces[after.last()];
-		//std::shuffle(space.begin(), space.end(), engine);
-		int bag[3], num = 0;
-		for (board::cell t = 1; t <= 3; t++)
-			for (size_t i = 0; i < after.bag(t); i++)
-				bag[num++] = t;
-		std::default_random_engine engine;
-		std::shuffle(bag, bag + num, engine);
-		board::cell tile = after.hint() ?: bag[--num];
-		board::cell hint = bag[--num];
+		//All feature weights are adjusted with the same TD error, shared by the isomorphic patterns.
+		if (error.empty()) {
+			network::update(tables, index, adjustment / network::isomorphisms());
+		} else {
+			//TC learning scales the adjustment of each entry by the coherence of its past errors.
+			network::visit(index, [&](unsigned k, uint32_t i, float share) {
+				float coherence = abserror[k][i] != 0 ? std::abs(error[k][i]) / abserror[k][i] : 1;
+				tables[k][i] += coherence * share * adjustment / network::isomorphisms();
+				error[k][i] += share * TDerror;
+				abserror[k][i] += share * std::abs(TDerror);
+			});
+		}
+		return network::estimate(tables, index);
+	}
 
-		for (int pos : space) {
-			if (after(pos) != 0) continue;
+	/**
+	 * expectimax value of an afterstate, i.e., a chance node over every legal placement and every hint tile,
+	 * followed by max nodes over the slides, whose afterstates are searched for depth - 1 more chance nodes
+	 * the afterstates of the last max nodes are scored by the network
+	 */
+	float expectationEstimate(const bitboard& after, unsigned depth = 1) const {
+		float expectation = 0.0;
+		if (expired()) return expectation;
+		if (!tt.empty() && tt.probe(after, depth, transposition::chance_node, expectation)) return expectation;
+
+		bitboard befores[144];
+		float weights[144];
+		int emptySpace = placements(after, befores, weights);
+		if (depth > 1) {
+			//The placements of larger chance nodes are searched in parallel, and summed in the same order afterward.
+			float values[144];
+			worker_pool::group children;
+			for (int i = 0; i < emptySpace; i++) {
+				auto search = [=, &befores, &values]() { values[i] = maxEstimate(befores[i], depth - 1); };
+				if (pool && emptySpace > 1) pool->spawn(children, search);
+				else search();
+			}
+			if (pool) pool->wait(children);
+			for (int i = 0; i < emptySpace; i++)
+				expectation += weights[i] * values[i];
+			if (!tt.empty() && !timeout) tt.store(after, depth, transposition::chance_node, expectation);
+			return expectation;
+		}
 
-			board b = board(after);
-			b.place(pos, tile, hint); // place 1, 2, 3
+		//Collect the legal afterstates of all placements first, so that their evaluations are pipelined.
+		bitboard afterstates[144 * 4];
+		int rewards[144 * 4];
+		float values[144 * 4];
+		int begin[145], num = 0;
+		for (int i = 0; i < emptySpace; i++) {
+			begin[i] = num;
+			for(int op : opcode){
+				afterstates[num] = befores[i];
+				rewards[num] = afterstates[num].slide(op);
+				if(rewards[num] != -1) num++;
+			}
+		}
+		begin[emptySpace] = num;
+		//The afterstates are evaluated in chunks, so that a large chance node can be aborted in the middle.
+		for (int k = 0; k < num; k += 64) {
+			if (expired()) return expectation;
+			valueEstimate(afterstates + k, values + k, std::min(num - k, 64));
+		}
+
+		for (int i = 0; i < emptySpace; i++) {
 			int bestReward = -1;
 			float bestValue = -100000;
-			for(int op : opcode){
-				board afterstate = b;
-				int reward = afterstate.slide(op);
-				if(reward == -1) continue;
-				float value = valueEstimate(afterstate);
-				if(reward + value > bestReward + bestValue){
-					bestReward = reward;
-					bestValue = value;
-					//bestOP = op;
-					//bestAfterstate = afterstate;
+			for(int k = begin[i]; k < begin[i + 1]; k++){
+				if(rewards[k] + values[k] > bestReward + bestValue){
+					bestReward = rewards[k];
+					bestValue = values[k];
 				}
 			}
 
-			expectation += (bestReward + bestValue);
-			emptySpace += 1;		
+			expectation += weights[i] * (bestReward + bestValue);
 		}
-
-		expectation = expectation / emptySpace;
+		if (!tt.empty() && !timeout) tt.store(after, depth, transposition::chance_node, expectation);
 		return expectation;
+	}
+	/**
+	 * expectimax value of a state before sliding, i.e., a max node over the slides,
+	 * whose afterstates are chance nodes searched with the given depth
+	 */
+	float maxEstimate(const bitboard& before, unsigned depth) const {
+		float value = 0.0;
+		if (!tt.empty() && tt.probe(before, depth, transposition::max_node, value)) return value;
 
+		int bestReward = -1;
+		float bestValue = -100000;
+		for(int op : opcode){
+			bitboard afterstate = before;
+			int reward = afterstate.slide(op);
+			if(reward == -1) continue;
+			float expectation = expectationEstimate(afterstate, depth);
+			if(reward + expectation > bestReward + bestValue){
+				bestReward = reward;
+				bestValue = expectation;
+			}
+		}
+		value = bestReward + bestValue;
+		if (!tt.empty() && !timeout) tt.store(before, depth, transposition::max_node, value);
+		return value;
 	}
 
 	virtual void open_episode(const std::string & flag = ""){
 		replayBuffer.clear();
 	}
 	virtual void close_episode(const std::string& flag = ""){
+		learn(replayBuffer);
+#if defined(PROFILE_NETWORK)
+		profile->close_episode();
+#endif
+	}
+	/**
+	 * the backward TD updates of an episode, which may be played by another agent
+	 */
+	template<typename buffer>
+	void learn(buffer& replayBuffer) {
 		if (replayBuffer.empty() || alpha == 0) return;
 		//We have to update 0 to terminal afterstate so that it can converge.
-		valueAdjust(replayBuffer[replayBuffer.size() - 1].afterstate, 0);
-		//The backward method updates the afterstates from the end to the beginning.
+		step& last = replayBuffer[replayBuffer.size() - 1];
+		last.value = valueAdjust(last.index, 0);
+		//The backward method updates the afterstates from the end to the beginning, and the adjusted values become the TD targets.
 		for(int t = replayBuffer.size() - 2; t >= 0; t--) {
-			float TDtarget = replayBuffer[t+1].reward + valueEstimate(replayBuffer[t+1].afterstate);
-			valueAdjust(replayBuffer[t].afterstate, TDtarget);
+			float TDtarget = replayBuffer[t+1].reward + replayBuffer[t+1].value;
+			replayBuffer[t].value = valueAdjust(replayBuffer[t].index, TDtarget);
 		}
 	}
+	/**
+	 * take over the afterstates and rewards of the current episode, e.g., to be learned by another agent
+	 */
+	std::vector<step> trajectory() {
+		std::vector<step> episode;
+		episode.reserve(replayBuffer.size());
+		for (size_t t = 0; t < replayBuffer.size(); t++)
+			episode.push_back(replayBuffer[t]);
+		replayBuffer.clear();
+		return episode;
+	}
+
+private:
+	/**
+	 * whether the time budget of the current move runs out, which is only checked in iterative deepening
+	 */
+	bool expired() const {
+		if (budget == 0) return false;
+		if (timeout.load(std::memory_order_relaxed)) return true;
+		if (std::chrono::steady_clock::now() < deadline) return false;
+		timeout = true;
+		return true;
+	}
+	/**
+	 * enumerate the outcomes of the placer on an afterstate, and return the number of outcomes
+	 * the placing position is uniform over the empty cells of the space,
+	 * the tile is the hint (or drawn from the bag if there is no hint yet), and the next hint is drawn from the bag
+	 */
+	int placements(const bitboard& after, bitboard before[], float weight[]) const {
+		const std::vector<int>& space = spaces[after.last()];
+		int emptySpace = 0;
+		for (int pos : space)
+			if (after(pos) == 0) emptySpace++;
+
+		int num = 0;
+		for (board::cell tile = 1; tile <= 3; tile++) {
+			bitboard drawn = after;
+			float chance = 1;
+			if (after.hint() == 0) {
+				if (after.bag(tile) == 0) continue;
+				chance = float(after.bag(tile)) / (after.bag(1) + after.bag(2) + after.bag(3));
+				drawn.extract_hint_from_bag(tile);
+			} else if (after.hint() != tile) continue;
+
+			unsigned bagSize = drawn.bag(1) + drawn.bag(2) + drawn.bag(3);
+			for (board::cell hint = 1; hint <= 3; hint++) {
+				if (drawn.bag(hint) == 0) continue;
+				for (int pos : space) {
+					if (after(pos) != 0) continue;
+					before[num] = after;
+					before[num].place(pos, tile, hint);
+					weight[num++] = chance * drawn.bag(hint) / bagSize / emptySpace;
+				}
+			}
+		}
+		return num;
+	}
+
+	template<typename table>
+	void pipelineEstimate(const table* tables, const bitboard after[], float value[], size_t num) const {
+		const size_t distance = 2; // afterstates in flight ahead of the one being accumulated
+		uint32_t index[distance + 1][network::features()];
+		for (size_t i = 0; i < std::min(distance, num); i++) {
+			network::extract(after[i], index[i]);
+			network::prefetch(tables, index[i]);
+		}
+		for (size_t i = 0; i < num; i++) {
+			if (i + distance < num) {
+				uint32_t* ahead = index[(i + distance) % (distance + 1)];
+				network::extract(after[i + distance], ahead);
+				network::prefetch(tables, ahead);
+			}
+			value[i] = network::estimate(tables, index[i % (distance + 1)]);
+#if defined(PROFILE_NETWORK)
+			network::visit(index[i % (distance + 1)], [&](unsigned k, uint32_t x, float share) {
+				profile->hit(k, x, tables[k][x] == 0);
+			});
+#endif
+		}
+	}
+
+	/**
+	 * whether the tables are empty or have the sizes of the network
+	 */
+	template<typename table>
+	static bool fits(const std::vector<table>& tables) {
+		std::string sizes;
+		for (const table& t : tables) sizes += (sizes.size() ? "," : "") + std::to_string(t.size());
+		return tables.empty() || sizes == network::sizes();
+	}
 
 protected:
-	std::vector<step> replayBuffer;
+	ring_buffer<step> replayBuffer; // the steps of the current episode, kept only when learning
 private:
 	std::array<int, 4> opcode;
 	std::vector<int> spaces[5];
+	unsigned depth; // the number of chance nodes searched below each slide
+	mutable transposition tt;
+	std::unique_ptr<worker_pool> pool; // the search is parallelized if threads > 1
+	float budget; // the time budget of each move in seconds, or 0 to search with a fixed depth
+	std::chrono::steady_clock::time_point deadline;
+	mutable std::atomic<bool> timeout; // the search is aborted, and the values stored afterward are invalid
+#if defined(PROFILE_NETWORK)
+	std::shared_ptr<network_profile> profile; // the lookups and the evaluation time, shown every "profile" (default 1000) episodes
+#endif
 };
 
+typedef basic_td_agent<tuple6_network> td_agent;
+
 /**
  * default random environment, i.e., placer
  * place the hint tile and decide a new hint tile
@@ -0,0 +1,131 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * allocator.h: Page-aware allocation for large lookup tables
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <algorithm>
+#include <string>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * process-wide policy of allocating large lookup tables
+ *
+ * page: "normal", "thp" (transparent huge pages via madvise), or "huge" (explicit huge pages via MAP_HUGETLB)
+ * numa: "none", "interleave" (each table spread over all nodes), or "pin" (tables assigned to nodes in turn)
+ *
+ * explicit huge pages fall back to transparent huge pages, which in turn fall back to normal pages,
+ * and the NUMA policy is only a hint that is ignored if the system does not support it
+ */
+class allocation {
+public:
+	enum page_type { normal, thp, huge };
+	enum numa_type { none, interleave, pin };
+
+	static allocation& policy() {
+		static allocation p;
+		return p;
+	}
+
+	void configure(const std::string& page_opt, const std::string& numa_opt) {
+		if (page_opt == "thp") page = thp;
+		else if (page_opt == "huge") page = huge;
+		else page = normal;
+		if (numa_opt == "interleave") numa = interleave;
+		else if (numa_opt == "pin") numa = pin;
+		else numa = none;
+	}
+
+	/**
+	 * tables smaller than a huge page are left to posix_memalign, which honours over-aligned entries unlike operator new
+	 */
+	static constexpr size_t huge_page() { return size_t(2) << 20; }
+	static bool large(size_t bytes) { return bytes >= huge_page(); }
+	static size_t round(size_t bytes) { return (bytes + huge_page() - 1) / huge_page() * huge_page(); }
+
+	void* allocate(size_t bytes, size_t align = alignof(std::max_align_t)) {
+		if (!large(bytes)) {
+			void* p = nullptr;
+			if (posix_memalign(&p, std::max(align, sizeof(void*)), std::max<size_t>(bytes, 1)) != 0) throw std::bad_alloc();
+			return p;
+		}
+		size_t len = round(bytes);
+		void* p = MAP_FAILED;
+		if (page == huge)
+			p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p == MAP_FAILED) {
+			// over-allocate by one huge page and trim, so that the table starts at a huge page boundary
+			char* raw = static_cast<char*>(mmap(nullptr, len + huge_page(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+			if (raw == MAP_FAILED) throw std::bad_alloc();
+			char* head = raw + (huge_page() - reinterpret_cast<uintptr_t>(raw) % huge_page()) % huge_page();
+			if (head != raw) munmap(raw, head - raw);
+			munmap(head + len, raw + len + huge_page() - (head + len));
+			p = head;
+			if (page != normal) madvise(p, len, MADV_HUGEPAGE);
+		}
+		bind(p, len);
+		return p;
+	}
+
+	void deallocate(void* p, size_t bytes) {
+		if (!large(bytes)) return std::free(p);
+		munmap(p, round(bytes));
+	}
+
+private:
+	allocation() : page(normal), numa(none), nodes(online_nodes()), turn(0) {}
+
+	/**
+	 * apply the NUMA policy with mbind before the pages are touched
+	 */
+	void bind(void* p, size_t len) {
+		if (numa == none || nodes <= 1) return;
+		const int mpol_preferred = 1, mpol_interleave = 3;
+		unsigned long mask = 0;
+		if (numa == interleave) mask = (nodes >= 64) ? ~0ul : (1ul << nodes) - 1;
+		else mask = 1ul << (turn++ % std::min(nodes, 64u));
+		syscall(SYS_mbind, p, len, numa == interleave ? mpol_interleave : mpol_preferred, &mask, 64, 0);
+	}
+
+	/**
+	 * the number of NUMA nodes, e.g., 2 for "0-1"
+	 */
+	static unsigned online_nodes() {
+		std::ifstream in("/sys/devices/system/node/online");
+		unsigned last = 0;
+		for (char ch; in.get(ch); ) {
+			if (ch >= '0' && ch <= '9') in.unget(), in >> last;
+		}
+		return last + 1;
+	}
+
+	page_type page;
+	numa_type numa;
+	unsigned nodes;
+	unsigned turn;
+};
+
+/**
+ * allocator for the entries of lookup tables, following allocation::policy()
+ */
+template<typename T>
+class table_allocator {
+public:
+	typedef T value_type;
+
+	table_allocator() {}
+	template<typename U> table_allocator(const table_allocator<U>&) {}
+
+	T* allocate(size_t n) { return static_cast<T*>(allocation::policy().allocate(n * sizeof(T), alignof(T))); }
+	void deallocate(T* p, size_t n) { allocation::policy().deallocate(p, n * sizeof(T)); }
+
+	template<typename U> bool operator ==(const table_allocator<U>&) const { return true; }
+	template<typename U> bool operator !=(const table_allocator<U>&) const { return false; }
+};
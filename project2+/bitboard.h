@@ -0,0 +1,367 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * bitboard.h: Define the packed game state of Threes! for search and learning
+ */
+
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include "board.h"
+#if defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+/**
+ * bitboard-based board for Threes!
+ *
+ * the 16 tile indices are packed as 4-bit nibbles of a 64-bit integer,
+ * the tile at index (0) is stored at the most significant nibble
+ *
+ * index (1-d form):
+ *  (0)  (1)  (2)  (3)
+ *  (4)  (5)  (6)  (7)
+ *  (8)  (9) (10) (11)
+ * (12) (13) (14) (15)
+ *
+ * i.e., the raw data reads 0x(0)(1)(2)(3)(4)(5)(6)(7)(8)(9)(10)(11)(12)(13)(14)(15),
+ * so that the ordering of raw data matches the ordering of board
+ *
+ * the hint, last action, and bag are kept in the same layout as board
+ */
+class bitboard {
+public:
+	typedef board::cell cell;
+	typedef uint64_t grid;
+	typedef board::data data;
+	typedef board::score score;
+	typedef board::reward reward;
+
+	/**
+	 * reference to a single tile of the packed grid
+	 */
+	class reference {
+	public:
+		reference(grid& raw, unsigned i) : raw(raw), shift(60 - 4 * i) {}
+		operator cell() const { return (raw >> shift) & 0x0fu; }
+		reference& operator =(cell t) { raw = (raw & ~(grid(0x0fu) << shift)) | (grid(t & 0x0fu) << shift); return *this; }
+		reference& operator =(const reference& r) { return operator =(cell(r)); }
+	private:
+		grid& raw;
+		unsigned shift;
+	};
+
+public:
+	bitboard() : tile(0), attr(0) { reset(); }
+	bitboard(grid b, data v = 0) : tile(b), attr(v) {}
+	bitboard(const board& b) : tile(0), attr(b.info()) {
+		for (unsigned i = 0; i < 16; i++) operator()(i) = b(i);
+	}
+	bitboard(const bitboard& b) = default;
+	bitboard& operator =(const bitboard& b) = default;
+
+	operator board() const {
+		board b(board::grid(), info());
+		for (unsigned i = 0; i < 16; i++) b(i) = operator()(i);
+		return b;
+	}
+
+	grid raw() const { return tile; }
+	grid raw(grid b) { grid old = tile; tile = b; return old; }
+	reference operator ()(unsigned i) { return reference(tile, i); }
+	cell operator ()(unsigned i) const { return (tile >> (60 - 4 * i)) & 0x0fu; }
+
+	data info() const { return attr; }
+	data info(data dat) { data old = attr; attr = dat; return old; }
+
+private:
+	data info4(size_t i) const { return (info() >> (4 * i)) & 0x0fu; }
+	data info4(size_t i, data dat) { data old = info4(i); info(info() ^ ((old ^ dat) << (4 * i))); return old; }
+
+public:
+	cell hint() const { return info4(0); }
+	cell hint(cell t) { return info4(0, t); }
+	unsigned last() const { return info4(1); }
+	unsigned last(unsigned a) { return info4(1, a); }
+	unsigned bag(cell t) const { return info4(t + 1); }
+	unsigned bag(cell t, unsigned n) { return info4(t + 1, n); }
+
+	void reset() {
+		hint(0);
+		last(4);
+		reset_bag();
+	}
+	void reset_bag() {
+		for (cell t = 1; t <= 3; t++) bag(t, 1);
+	}
+	bool extract_hint_from_bag(cell t) {
+		if (bag(t) < 1) return false;
+		bag(t, bag(t) - 1);
+		if (bag(1) + bag(2) + bag(3) == 0) reset_bag();
+		hint(t);
+		return true;
+	}
+	unsigned value() const {
+		score v = 0;
+		for (unsigned i = 0; i < 16; i++) v += board::itov(operator()(i));
+		return v;
+	}
+	cell max() const {
+		cell t = 0;
+		for (unsigned i = 0; i < 16; i++) t = std::max(t, operator()(i));
+		return t;
+	}
+
+public:
+	bool operator ==(const bitboard& b) const { return tile == b.tile; }
+	bool operator < (const bitboard& b) const { return tile <  b.tile; }
+	bool operator !=(const bitboard& b) const { return !(*this == b); }
+	bool operator > (const bitboard& b) const { return b < *this; }
+	bool operator <=(const bitboard& b) const { return !(b < *this); }
+	bool operator >=(const bitboard& b) const { return !(*this < b); }
+
+public:
+
+	/**
+	 * place a tile (index value) to the specific position (1-d index)
+	 * return >= 0 if the action is valid, or -1 if not
+	 */
+	reward place(unsigned pos, cell tile, cell hint_tile) {
+		data bak = info();
+		if (pos >= 16 || operator()(pos)) return -1;
+		if (hint() == 0 && !extract_hint_from_bag(tile)) return -1;
+		if (hint() != tile) return info(bak), -1;
+		if (!extract_hint_from_bag(hint_tile)) return info(bak), -1;
+		operator()(pos) = tile;
+		last(4);
+		return board::itov(tile);
+	}
+
+	/**
+	 * apply an action to the board
+	 * return the reward of the action, or -1 if the action is illegal
+	 */
+	reward slide(unsigned opcode) {
+		reward r = -1;
+		switch (opcode & 0b11) {
+		case 0: r = slide_up(); break;
+		case 1: r = slide_right(); break;
+		case 2: r = slide_down(); break;
+		case 3: r = slide_left(); break;
+		}
+		if (r != -1) last(opcode & 0b11);
+		return r;
+	}
+
+	reward slide_left() {
+		return slide_rows(lookup::find().left);
+	}
+	reward slide_right() {
+		return slide_rows(lookup::find().right);
+	}
+	reward slide_up() {
+		return slide_cols(lookup::find().left);
+	}
+	reward slide_down() {
+		return slide_cols(lookup::find().right);
+	}
+
+	void rotate(int clockwise_count = 1) {
+		switch (((clockwise_count % 4) + 4) % 4) {
+		default:
+		case 0: break;
+		case 1: rotate_clockwise(); break;
+		case 2: reverse(); break;
+		case 3: rotate_counterclockwise(); break;
+		}
+	}
+
+	void rotate_clockwise() { transpose(); reflect_horizontal(); }
+	void rotate_counterclockwise() { transpose(); reflect_vertical(); }
+	void reverse() { reflect_horizontal(); reflect_vertical(); }
+
+	void reflect_horizontal() {
+		tile = ((tile & 0xf000f000f000f000ull) >> 12) | ((tile & 0x0f000f000f000f00ull) >> 4)
+		     | ((tile & 0x00f000f000f000f0ull) << 4)  | ((tile & 0x000f000f000f000full) << 12);
+	}
+
+	void reflect_vertical() {
+		tile = (tile >> 48) | ((tile >> 16) & 0x00000000ffff0000ull)
+		     | (tile << 48) | ((tile << 16) & 0x0000ffff00000000ull);
+	}
+
+	void transpose() {
+		grid a = (tile & 0xf0f00f0ff0f00f0full)
+		       | ((tile & 0x0000f0f00000f0f0ull) << 12) | ((tile & 0x0f0f00000f0f0000ull) >> 12);
+		tile = (a & 0xff00ff0000ff00ffull)
+		     | ((a & 0x00ff00ff00000000ull) >> 24) | ((a & 0x00000000ff00ff00ull) << 24);
+	}
+
+private:
+	/**
+	 * slide result of a 16-bit packed row, i.e., 0x(c0)(c1)(c2)(c3)
+	 */
+	struct line {
+		uint16_t row;
+		bool moved;
+		reward score;
+	};
+
+	/**
+	 * precomputed slide results of all rows for both horizontal directions,
+	 * generated by the reference implementation in board::slide_left
+	 */
+	struct lookup {
+		line left[65536];
+		line right[65536];
+
+		lookup() {
+			for (unsigned row = 0; row < 65536; row++) {
+				board b(board::grid(), 0);
+				for (unsigned c = 0; c < 4; c++) b(c) = (row >> (12 - 4 * c)) & 0x0fu;
+				reward score = b.slide_left();
+				unsigned res = 0;
+				for (unsigned c = 0; c < 4; c++) res = (res << 4) | b(c);
+				left[row] = { uint16_t(res), score != -1, std::max(score, 0) };
+				right[reverse_row(row)] = { uint16_t(reverse_row(res)), score != -1, std::max(score, 0) };
+			}
+		}
+
+		static unsigned reverse_row(unsigned row) {
+			return ((row & 0x000fu) << 12) | ((row & 0x00f0u) << 4) | ((row & 0x0f00u) >> 4) | ((row & 0xf000u) >> 12);
+		}
+
+		static const lookup& find() {
+			static const lookup table;
+			return table;
+		}
+	};
+
+	reward slide_rows(const line* table) {
+		grid res = 0;
+		reward score = 0;
+		bool moved = false;
+		for (unsigned r = 0; r < 64; r += 16) {
+			const line& l = table[(tile >> r) & 0xffffu];
+			res |= grid(l.row) << r;
+			score += l.score;
+			moved |= l.moved;
+		}
+		if (!moved) return -1;
+		tile = res;
+		return score;
+	}
+
+	/**
+	 * columns are packed into the same 16-bit form as rows, i.e., 0x(r0)(r1)(r2)(r3),
+	 * so that sliding up (down) shares the table of sliding left (right)
+	 */
+	reward slide_cols(const line* table) {
+		grid res = 0;
+		reward score = 0;
+		bool moved = false;
+		for (unsigned c = 0; c < 16; c += 4) {
+			grid t = (tile << c) & 0xf000f000f000f000ull;
+			const line& l = table[((t >> 48) | (t >> 36) | (t >> 24) | (t >> 12)) & 0xffffu];
+			grid v = l.row;
+			res |= (((v & 0xf000u) << 48) | ((v & 0x0f00u) << 36) | ((v & 0x00f0u) << 24) | ((v & 0x000fu) << 12)) >> c;
+			score += l.score;
+			moved |= l.moved;
+		}
+		if (!moved) return -1;
+		tile = res;
+		return score;
+	}
+
+public:
+
+	/**
+	 * generate all 8 isomorphisms of the tile grid in one pass, in the order of
+	 * rotating clockwise 0-3 times, then reflecting horizontally and rotating clockwise 0-3 times
+	 *
+	 * isomorphism k takes its tile at index (i) from index (permutation[k][i]) of this board
+	 */
+	void isomorphisms(grid iso[8]) const {
+		alignas(32) static constexpr uint8_t permutation[8][16] = {
+			{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+			{ 12,  8,  4,  0, 13,  9,  5,  1, 14, 10,  6,  2, 15, 11,  7,  3 },
+			{ 15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1,  0 },
+			{  3,  7, 11, 15,  2,  6, 10, 14,  1,  5,  9, 13,  0,  4,  8, 12 },
+			{  3,  2,  1,  0,  7,  6,  5,  4, 11, 10,  9,  8, 15, 14, 13, 12 },
+			{ 15, 11,  7,  3, 14, 10,  6,  2, 13,  9,  5,  1, 12,  8,  4,  0 },
+			{ 12, 13, 14, 15,  8,  9, 10, 11,  4,  5,  6,  7,  0,  1,  2,  3 },
+			{  0,  4,  8, 12,  1,  5,  9, 13,  2,  6, 10, 14,  3,  7, 11, 15 },
+		};
+#if defined(__SSSE3__)
+		// unpack the byte-swapped grid so that byte (i) holds the tile at index (i)
+		const __m128i low4 = _mm_set1_epi8(0x0f);
+		const __m128i swapped = _mm_cvtsi64_si128(__builtin_bswap64(tile));
+		const __m128i tiles = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(swapped, 4), low4), _mm_and_si128(swapped, low4));
+		const auto* perm = reinterpret_cast<const __m128i*>(permutation);
+#if defined(__AVX2__)
+		// two isomorphisms per register, arranged so that packing yields them in order
+		const __m256i pair = _mm256_broadcastsi128_si256(tiles);
+		const __m256i scale = _mm256_set1_epi16(0x0110);
+		auto shuffle = [&](unsigned a, unsigned b) -> __m256i {
+			__m256i mask = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_load_si128(perm + a)), _mm_load_si128(perm + b), 1);
+			return _mm256_maddubs_epi16(_mm256_shuffle_epi8(pair, mask), scale);
+		};
+		for (unsigned k = 0; k < 8; k += 4) {
+			__m256i packed = _mm256_packus_epi16(shuffle(k + 0, k + 2), shuffle(k + 1, k + 3));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(iso + k), packed);
+		}
+#else
+		const __m128i scale = _mm_set1_epi16(0x0110);
+		auto shuffle = [&](unsigned k) -> __m128i {
+			return _mm_maddubs_epi16(_mm_shuffle_epi8(tiles, _mm_load_si128(perm + k)), scale);
+		};
+		for (unsigned k = 0; k < 8; k += 2) {
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(iso + k), _mm_packus_epi16(shuffle(k), shuffle(k + 1)));
+		}
+#endif
+		for (unsigned k = 0; k < 8; k++) iso[k] = __builtin_bswap64(iso[k]);
+#else
+		(void) permutation; // the scalar fallback composes the same isomorphisms from bitwise operations
+		bitboard state(tile);
+		for (unsigned k = 0; k < 8; k++) {
+			if (k == 4) state.reflect_horizontal();
+			iso[k] = state.raw();
+			state.rotate_clockwise();
+		}
+#endif
+	}
+
+public:
+	friend std::ostream& operator <<(std::ostream& out, const bitboard& b) {
+		return out << board(b);
+	}
+	friend std::istream& operator >>(std::istream& in, bitboard& b) {
+		board tmp(board::grid(), b.info());
+		in >> tmp;
+		b = bitboard(tmp);
+		return in;
+	}
+
+private:
+	grid tile;
+	data attr; // (#3-tile:4-bit) (#2-tile:4-bit) (#1-tile:4-bit) (last_action:4-bit) (hint_tile:4-bit)
+};
+
+namespace std {
+/**
+ * hash of the tile grid, consistent with bitboard::operator ==
+ */
+template<> struct hash<bitboard> {
+	size_t operator ()(const bitboard& b) const {
+		uint64_t h = b.raw();
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ull;
+		h ^= h >> 33;
+		return h;
+	}
+};
+}
@@ -0,0 +1,160 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * checkpoint.h: Asynchronous and resumable checkpoints of training
+ */
+
+#pragma once
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include "weight.h"
+
+/**
+ * periodic checkpoints of float tables and the states of training, e.g., random engines and statistics
+ *
+ * a checkpoint at "path" consists of the state file "path" and two weight files "path.0" and "path.1",
+ * where the state file names the weight file of the latest completed checkpoint, and checkpoints alternate between the weight files,
+ * so that an interrupted checkpoint never damages the latest completed one
+ *
+ * the tables are copied into a snapshot (double buffer) on save, and written by a background thread while training continues,
+ * where only the tables changed since the last write of the same weight file are written
+ *
+ * the weight files follow the layout of weight_header, i.e., they can also be loaded directly by weight_agent
+ */
+class checkpoint {
+public:
+	checkpoint(const std::string& path) : path(path), current(-1) {
+		std::ifstream in(path);
+		std::string name;
+		if (in >> name >> name) current = (name == path + ".1") ? 1 : 0;
+	}
+	~checkpoint() {
+		wait();
+	}
+
+	/**
+	 * take a snapshot of the tables and the states, and write them in background
+	 * the previous checkpoint is waited for if it is still being written
+	 */
+	void save(const std::vector<weight*>& tables, const std::string& state) {
+		wait();
+		if (snapshot.size() != tables.size()) {
+			snapshot.clear();
+			for (weight* w : tables) snapshot.emplace_back(w->size());
+			for (int i = 0; i < 2; i++) dirty[i].assign(tables.size(), true);
+		}
+		for (size_t k = 0; k < tables.size(); k++) {
+			weight& live = *tables[k];
+			if (snapshot[k].size() != live.size()) {
+				snapshot[k] = weight(live.size());
+			} else if (std::memcmp(snapshot[k].data(), live.data(), sizeof(weight::type) * live.size()) == 0) {
+				continue; // not changed since the last snapshot
+			}
+			std::copy(live.data(), live.data() + live.size(), snapshot[k].data());
+			dirty[0][k] = dirty[1][k] = true;
+		}
+		writer = std::thread(&checkpoint::write, this, current == 0 ? 1 : 0, state);
+	}
+	/**
+	 * wait for the checkpoint being written, where a failure of the writer is reported here in the training thread
+	 */
+	void wait() {
+		if (writer.joinable()) writer.join();
+		if (failure.size()) {
+			std::cerr << "checkpoint failed: " << failure << std::endl;
+			std::exit(-1);
+		}
+	}
+
+	/**
+	 * read the latest completed checkpoint into the tables, whose sizes should match, and return the saved states
+	 */
+	static std::string restore(const std::string& path, const std::vector<weight*>& tables) {
+		std::ifstream in(path);
+		std::string tag, name;
+		if (!(in >> tag >> name) || tag != "weights") std::exit(-1);
+		in.ignore();
+		std::string state((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+		std::ifstream file(name, std::ios::in | std::ios::binary);
+		weight_header head;
+		if (!file.read(reinterpret_cast<char*>(&head), sizeof(head))) std::exit(-1);
+		if (head.signature != weight_header::magic() || head.element != 0 || head.count != tables.size()) std::exit(-1);
+		std::vector<weight_header::entry> entry(head.count);
+		file.read(reinterpret_cast<char*>(entry.data()), sizeof(weight_header::entry) * entry.size());
+		for (size_t k = 0; k < tables.size(); k++) {
+			if (entry[k].size != tables[k]->size()) std::exit(-1);
+			file.seekg(entry[k].offset);
+			file.read(reinterpret_cast<char*>(tables[k]->data()), sizeof(weight::type) * entry[k].size);
+		}
+		if (!file) std::exit(-1);
+		return state;
+	}
+
+private:
+	/**
+	 * write the dirty tables of the snapshot into the target weight file in place,
+	 * and then replace the state file to name the target weight file
+	 */
+	void write(int target, const std::string& state) {
+		std::string name = path + "." + std::to_string(target);
+		const uint64_t align = 4096;
+		weight_header head = { weight_header::magic(), 1, uint32_t(snapshot.size()), 0, align, 0 };
+		std::vector<weight_header::entry> entry(snapshot.size());
+		uint64_t offset = sizeof(weight_header) + sizeof(weight_header::entry) * snapshot.size();
+		for (size_t k = 0; k < snapshot.size(); k++) {
+			offset = (offset + align - 1) / align * align;
+			entry[k] = { offset, snapshot[k].size(), 1, 0 };
+			offset += sizeof(weight::type) * snapshot[k].size();
+		}
+
+		int fd = open(name.c_str(), O_RDWR | O_CREAT, 0644);
+		if (fd == -1) return fail(name);
+		bool ok = pwrite_all(fd, &head, sizeof(head), 0);
+		ok = ok && pwrite_all(fd, entry.data(), sizeof(weight_header::entry) * entry.size(), sizeof(head));
+		for (size_t k = 0; k < snapshot.size() && ok; k++) {
+			if (!dirty[target][k]) continue;
+			ok = pwrite_all(fd, snapshot[k].data(), sizeof(weight::type) * snapshot[k].size(), entry[k].offset);
+		}
+		ok = ok && ftruncate(fd, offset) == 0 && fsync(fd) == 0;
+		if (!ok) fail(name);
+		close(fd);
+		if (!ok) return;
+
+		std::ofstream out(path + ".tmp", std::ios::out | std::ios::trunc);
+		out << "weights " << name << std::endl << state;
+		out.close();
+		if (!out || std::rename((path + ".tmp").c_str(), path.c_str()) != 0) return fail(path);
+		dirty[target].assign(snapshot.size(), false);
+		current = target;
+	}
+	void fail(const std::string& name) {
+		failure = name + ": " + std::strerror(errno);
+	}
+	static bool pwrite_all(int fd, const void* buf, size_t len, uint64_t offset) {
+		const char* p = static_cast<const char*>(buf);
+		while (len) {
+			ssize_t n = pwrite(fd, p, len, offset);
+			if (n <= 0) return false;
+			p += n, len -= n, offset += n;
+		}
+		return true;
+	}
+
+	std::string path;
+	int current; // the weight file of the latest completed checkpoint, or -1 if none
+	std::vector<weight> snapshot;
+	std::vector<bool> dirty[2]; // whether a table of the snapshot is newer than that in each weight file
+	std::thread writer;
+	std::string failure; // the file and the error of a failed write, or empty
+};
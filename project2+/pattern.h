@@ -0,0 +1,356 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * pattern.h: Compile-time n-tuple patterns and networks on packed boards
+ */
+
+#pragma once
+#include <cstdint>
+#include <string>
+#include <algorithm>
+#include <type_traits>
+#include "bitboard.h"
+#if defined(__BMI2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * n-tuple pattern, e.g., pattern<0, 1, 2, 3, 4, 5>
+ *
+ * the index of a pattern is the concatenation of its tiles,
+ * where the tile of the first cell is the most significant nibble,
+ * i.e., the same index as after(a) * 16^5 + after(b) * 16^4 + ... + after(f)
+ */
+template<unsigned... cells>
+class pattern {
+public:
+	static_assert(sizeof...(cells) > 0 && sizeof...(cells) <= 8, "pattern should have 1 to 8 cells");
+
+	static constexpr unsigned length() { return sizeof...(cells); }
+	static constexpr size_t size() { return size_t(1) << (4 * length()); }
+	static constexpr bitboard::grid mask() { return mask_of(cells...); }
+	static constexpr bool ascending() { return ascending_of(cells...); }
+	static constexpr bool contiguous() { return contiguous_of(cells...); }
+
+	/**
+	 * extract the index of this pattern from a packed grid
+	 * contiguous cells only take a shift and a mask, other ascending cells use pext if available
+	 */
+	static uint32_t index(bitboard::grid raw) {
+		if (contiguous()) return (raw & mask()) >> (60 - 4 * last_of(cells...));
+#if defined(__BMI2__)
+		if (ascending()) return _pext_u64(raw, mask());
+#endif
+		uint32_t index = 0;
+		int expand[] = { (index = (index << 4) | ((raw >> (60 - 4 * cells)) & 0x0fu), 0)... };
+		(void) expand;
+		return index;
+	}
+
+	/**
+	 * place the tiles of an index back on the cells of this pattern, i.e., the inverse of index
+	 */
+	static bitboard::grid deposit(uint32_t index) {
+		const unsigned cell[] = { cells... };
+		bitboard::grid raw = 0;
+		for (unsigned j = length(); j > 0; j--, index >>= 4)
+			raw |= bitboard::grid(index & 0x0fu) << (60 - 4 * cell[j - 1]);
+		return raw;
+	}
+
+private:
+	static constexpr bitboard::grid mask_of() { return 0; }
+	template<typename... rest>
+	static constexpr bitboard::grid mask_of(unsigned a, rest... b) { return (bitboard::grid(0x0fu) << (60 - 4 * a)) | mask_of(b...); }
+	static constexpr unsigned last_of(unsigned a) { return a; }
+	template<typename... rest>
+	static constexpr unsigned last_of(unsigned a, unsigned b, rest... c) { return last_of(b, c...); }
+	static constexpr bool ascending_of(unsigned a) { return true; }
+	template<typename... rest>
+	static constexpr bool ascending_of(unsigned a, unsigned b, rest... c) { return a < b && ascending_of(b, c...); }
+	static constexpr bool contiguous_of(unsigned a) { return true; }
+	template<typename... rest>
+	static constexpr bool contiguous_of(unsigned a, unsigned b, rest... c) { return a + 1 == b && contiguous_of(b, c...); }
+};
+
+/**
+ * n-tuple network declared by a list of patterns, e.g., network<8, pattern<0, 1, 2, 3>, pattern<4, 5, 6, 7>>
+ * where each pattern owns one weight table, and is evaluated on 1 (as is) or 8 (all isomorphisms) boards
+ *
+ * the feature indices are ordered by isomorphism first, i.e.,
+ * index[i * tables() + k] is the index of pattern k on isomorphism i
+ */
+template<unsigned isomorphism, typename... patterns>
+class network {
+public:
+	static_assert(isomorphism == 1 || isomorphism == 8, "network should be evaluated on 1 or 8 isomorphisms");
+
+	static constexpr unsigned isomorphisms() { return isomorphism; }
+	static constexpr unsigned tables() { return sizeof...(patterns); }
+	static constexpr unsigned features() { return isomorphisms() * tables(); }
+
+	/**
+	 * comma-separated sizes of weight tables, e.g., "65536,65536"
+	 */
+	static std::string sizes() {
+		std::string res;
+		int expand[] = { (res += (res.size() ? "," : "") + std::to_string(patterns::size()), 0)... };
+		(void) expand;
+		return res;
+	}
+
+	static void extract(const bitboard& after, uint32_t index[]) {
+		bitboard::grid iso[8];
+		if (isomorphisms() == 8) after.isomorphisms(iso);
+		else iso[0] = after.raw();
+		for (unsigned i = 0; i < isomorphisms(); i++)
+			extract(iso[i], index + i * tables(), order());
+	}
+
+	/**
+	 * sum the entries of all features, float tables are gathered with AVX2 if available
+	 */
+	template<typename table>
+	static float estimate(const table* net, const uint32_t index[]) {
+		return estimate(net, index, gatherable<table>());
+	}
+
+	/**
+	 * prefetch the entries of all features, so that the following estimate does not stall on each lookup
+	 */
+	template<typename table>
+	static void prefetch(const table* net, const uint32_t index[]) {
+		for (unsigned i = 0; i < isomorphisms(); i++)
+			prefetch(net, index + i * tables(), order());
+	}
+
+	template<typename table>
+	static void update(table* net, const uint32_t index[], float adjustment) {
+		for (unsigned i = 0; i < isomorphisms(); i++)
+			update(net, index + i * tables(), adjustment, order());
+	}
+
+	/**
+	 * visit every feature as f(k, index, share) where k is the table, e.g., for learning rules with per-entry states
+	 * and share is the portion of an adjustment taken by the entry, which is always 1 unless the indices are canonical
+	 */
+	template<typename visitor>
+	static void visit(const uint32_t index[], visitor&& f) {
+		for (unsigned i = 0; i < isomorphisms(); i++)
+			for (unsigned k = 0; k < tables(); k++) f(k, index[i * tables() + k], 1.0f);
+	}
+
+private:
+	template<unsigned... k> struct sequence {};
+	template<unsigned n, unsigned... k> struct make_sequence : make_sequence<n - 1, n - 1, k...> {};
+	template<unsigned... k> struct make_sequence<0, k...> { typedef sequence<k...> type; };
+	typedef typename make_sequence<sizeof...(patterns)>::type order;
+
+	template<unsigned... k>
+	static void extract(bitboard::grid raw, uint32_t index[], sequence<k...>) {
+		int expand[] = { (index[k] = patterns::index(raw), 0)... };
+		(void) expand;
+	}
+
+#if defined(__AVX2__)
+	static constexpr bool narrow() { return true; }
+	template<typename... rest>
+	static constexpr bool narrow(unsigned a, rest... b) { return a < 8 && narrow(b...); } // fits 32-bit signed gather indices
+	template<typename table>
+	struct gatherable : std::integral_constant<bool, std::is_same<typename table::type, float>::value
+		&& isomorphisms() == 8 && narrow(patterns::length()...)> {};
+#else
+	template<typename table>
+	struct gatherable : std::false_type {};
+#endif
+
+	template<typename table>
+	static float estimate(const table* net, const uint32_t index[], std::false_type) {
+		float value = 0;
+		for (unsigned i = 0; i < isomorphisms(); i++)
+			estimate(net, index + i * tables(), value, order());
+		return value;
+	}
+
+#if defined(__AVX2__)
+	/**
+	 * gather the entries of one pattern on all 8 isomorphisms at once,
+	 * whose indices are themselves gathered from the isomorphism-major index list
+	 */
+	template<typename table>
+	static float estimate(const table* net, const uint32_t index[], std::true_type) {
+		const __m256i stride = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(tables()));
+		__m256 sum = _mm256_setzero_ps();
+		for (unsigned k = 0; k < tables(); k++) {
+			__m256i feature = _mm256_i32gather_epi32(reinterpret_cast<const int*>(index + k), stride, 4);
+			sum = _mm256_add_ps(sum, _mm256_i32gather_ps(net[k].data(), feature, 4));
+		}
+		__m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+		half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+		half = _mm_add_ss(half, _mm_movehdup_ps(half));
+		return _mm_cvtss_f32(half);
+	}
+#endif
+
+	template<typename table, unsigned... k>
+	static void estimate(const table* net, const uint32_t index[], float& value, sequence<k...>) {
+		int expand[] = { (value += net[k][index[k]], 0)... };
+		(void) expand;
+	}
+
+	template<typename table, unsigned... k>
+	static void prefetch(const table* net, const uint32_t index[], sequence<k...>) {
+		int expand[] = { (net[k].prefetch(index[k]), 0)... };
+		(void) expand;
+	}
+
+	template<typename table, unsigned... k>
+	static void update(table* net, const uint32_t index[], float adjustment, sequence<k...>) {
+		int expand[] = { (net[k][index[k]] += adjustment, 0)... };
+		(void) expand;
+	}
+};
+
+/**
+ * n-tuple network whose feature indices are mapped to canonical indices, e.g., canonical<tuple6_network>
+ *
+ * if a reflection maps the cells of a pattern onto themselves, e.g., swapping the middle rows fixes pattern<4, 5, 6, 8, 9, 10>,
+ * the index x and its reflected index are always visited together on the 8 isomorphic boards, and their entries keep the same value;
+ * such indices share one entry of a smaller table, and an adjustment is divided among the indices sharing the entry,
+ * so that evaluation and learning behave the same as the full tables
+ *
+ * the reflection swaps the tiles of paired cells, i.e., the index is split into the fixed tiles f and the paired tiles h and l,
+ * and the reflected index swaps h and l, so that the canonical index is ranked arithmetically without remap lookups, as
+ * f * (m + m * (m - 1) / 2) + (h == l ? h : m + max(h, l) * (max(h, l) - 1) / 2 + min(h, l)), where m is the number of values of h
+ *
+ * patterns fixed by no reflection or by more than one isomorphism keep their full tables
+ */
+template<typename network> class canonical;
+template<unsigned isomorphism, typename... patterns>
+class canonical<network<isomorphism, patterns...>> : public network<isomorphism, patterns...> {
+public:
+	typedef network<isomorphism, patterns...> base;
+	static_assert(isomorphism == 8, "canonical indices need all 8 isomorphisms");
+
+	static std::string sizes() {
+		std::string res;
+		for (unsigned k = 0; k < base::tables(); k++)
+			res += (res.size() ? "," : "") + std::to_string(symmetry(k).size);
+		return res;
+	}
+
+	static void extract(const bitboard& after, uint32_t index[]) {
+		base::extract(after, index);
+		for (unsigned k = 0; k < base::tables(); k++) {
+			const reflection& s = symmetry(k);
+			if (s.pairs == 0) continue;
+			for (unsigned i = 0; i < isomorphism; i++)
+				index[i * base::tables() + k] = s.rank(index[i * base::tables() + k]);
+		}
+	}
+
+	template<typename table>
+	static void update(table* net, const uint32_t index[], float adjustment) {
+		visit(index, [=](unsigned k, uint32_t i, float share) { net[k][i] += adjustment * share; });
+	}
+
+	template<typename visitor>
+	static void visit(const uint32_t index[], visitor&& f) {
+		for (unsigned i = 0; i < isomorphism; i++) {
+			for (unsigned k = 0; k < base::tables(); k++) {
+				uint32_t x = index[i * base::tables() + k];
+				f(k, x, symmetry(k).share(x));
+			}
+		}
+	}
+
+private:
+	struct reflection {
+		unsigned pairs; // the number of pairs of cells, or 0 if the pattern keeps its full table
+		uint64_t span; // the number of ranks for each f, i.e., m + m * (m - 1) / 2
+		size_t size;
+		uint32_t mask[3]; // the tiles of h, l, and f in an index, if the cells of l follow the same order as their pairs in h
+		uint64_t split[4][256]; // the tiles of each byte of an index, placed in h (bits 0-15), l (bits 16-31), and f (bits 32-63)
+
+		uint32_t rank(uint32_t x) const {
+			uint32_t h, l, f;
+#if defined(__BMI2__)
+			if (mask[0]) {
+				h = _pext_u32(x, mask[0]), l = _pext_u32(x, mask[1]), f = _pext_u32(x, mask[2]);
+			} else
+#endif
+			{
+				uint64_t v = split[0][x & 0xffu] | split[1][(x >> 8) & 0xffu] | split[2][(x >> 16) & 0xffu] | split[3][x >> 24];
+				h = v & 0xffffu, l = (v >> 16) & 0xffffu, f = v >> 32;
+			}
+			uint32_t swap = (h ^ l) & -uint32_t(h < l), hi = h ^ swap, lo = l ^ swap;
+			uint32_t tri = (1u << (4 * pairs)) + hi * (hi - 1) / 2 + lo;
+			tri = h == l ? h : tri;
+			return f * uint32_t(span) + tri;
+		}
+		float share(uint32_t x) const {
+			return (pairs == 0 || x % span < (uint64_t(1) << (4 * pairs))) ? 1.0f : 0.5f;
+		}
+	};
+
+	static const reflection& symmetry(unsigned k) {
+		static const reflection* const table[] = { &symmetry_of<patterns>()... };
+		return *table[k];
+	}
+	template<typename pattern>
+	static const reflection& symmetry_of() {
+		static const reflection s = build<pattern>();
+		return s;
+	}
+
+	/**
+	 * find the isomorphism fixing the cells, and pair each cell with the cell whose tile it takes under the isomorphism
+	 */
+	template<typename pattern>
+	static reflection build() {
+		reflection res = {};
+		res.size = pattern::size();
+		bitboard::grid iso[8];
+		bitboard(pattern::mask()).isomorphisms(iso);
+		unsigned fixing = 0, g = 0;
+		for (unsigned i = 1; i < 8; i++)
+			if (iso[i] == pattern::mask()) fixing++, g = i;
+		if (fixing != 1) return res;
+
+		const unsigned n = pattern::length();
+		uint32_t marker = 0; // the tile of each cell is its position in the pattern, counted from 1
+		for (unsigned pos = 0; pos < n; pos++) marker = (marker << 4) | (pos + 1);
+		bitboard(pattern::deposit(marker)).isomorphisms(iso);
+		uint32_t moved = pattern::index(iso[g]);
+		unsigned shift[8], fixeds = 0; // the nibble in the split of each position
+		for (unsigned pos = 0; pos < n; pos++) {
+			unsigned from = ((moved >> (4 * (n - 1 - pos))) & 0x0fu) - 1;
+			if (from == pos) fixeds++;
+			else if (pos < from) res.pairs++;
+		}
+		for (unsigned pos = 0, f = 0, j = 0; pos < n; pos++) {
+			unsigned from = ((moved >> (4 * (n - 1 - pos))) & 0x0fu) - 1;
+			if (from == pos) shift[pos] = 32 + 4 * (fixeds - 1 - f++);
+			else if (pos < from) shift[pos] = 4 * (res.pairs - 1 - j), shift[from] = 16 + 4 * (res.pairs - 1 - j++);
+		}
+		bool ordered = true; // whether h, l, and f can be extracted by pext
+		for (unsigned pos = 0, last = 32; pos < n; pos++) {
+			if (shift[pos] < 16 || shift[pos] >= 32) continue;
+			ordered = ordered && shift[pos] < last;
+			last = shift[pos];
+		}
+		for (unsigned pos = 0; pos < n && ordered; pos++)
+			res.mask[std::min(shift[pos] / 16, 2u)] |= uint32_t(0x0fu) << (4 * (n - 1 - pos));
+		for (unsigned b = 0; b < 4; b++) {
+			for (uint32_t v = 0; v < 256; v++) {
+				for (unsigned q = 0; q < 2; q++) {
+					unsigned nibble = 2 * b + q; // counted from the least significant nibble of an index
+					if (nibble < n) res.split[b][v] |= uint64_t((v >> (4 * q)) & 0x0fu) << shift[n - 1 - nibble];
+				}
+			}
+		}
+		uint64_t m = uint64_t(1) << (4 * res.pairs);
+		res.span = m + m * (m - 1) / 2;
+		res.size = (size_t(1) << (4 * fixeds)) * res.span;
+		return res;
+	}
+};
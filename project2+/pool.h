@@ -0,0 +1,151 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * pool.h: Persistent worker pool with work-stealing for parallel search
+ */
+
+#pragma once
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+/**
+ * fork-join worker pool, e.g.,
+ * worker_pool::group g;
+ * for (int i = 0; i < n; i++) pool.spawn(g, [&, i]() { value[i] = search(child[i]); });
+ * pool.wait(g);
+ *
+ * each worker owns a queue, where spawned jobs are pushed to and popped from the back,
+ * and idle workers steal jobs from the front of the others' queues,
+ * i.e., the oldest and usually the largest jobs are stolen first
+ *
+ * the thread waiting for a group keeps running jobs, so that jobs may spawn and wait for nested groups,
+ * and threads outside the pool share the queue of index 0
+ */
+class worker_pool {
+public:
+	class group {
+	public:
+		group() : pending(0) {}
+	private:
+		friend class worker_pool;
+		std::atomic<size_t> pending;
+	};
+
+	/**
+	 * the caller takes part in the jobs while waiting, so that threads - 1 workers are launched
+	 */
+	worker_pool(unsigned threads) : queues(std::max(threads, 1u)), queued(0), stop(false) {
+		for (unsigned i = 1; i < queues.size(); i++)
+			workers.emplace_back(&worker_pool::work, this, i);
+	}
+	~worker_pool() {
+		{
+			std::lock_guard<std::mutex> lock(sleep);
+			stop = true;
+		}
+		wake.notify_all();
+		for (std::thread& worker : workers) worker.join();
+	}
+
+	unsigned size() const { return queues.size(); }
+
+	template<typename task>
+	void spawn(group& g, task&& run) {
+		g.pending++;
+		queue& q = queues[self()];
+		{
+			std::lock_guard<std::mutex> lock(q.lock);
+			q.jobs.push_back({ std::function<void()>(std::forward<task>(run)), &g });
+		}
+		queued++;
+		{
+			std::lock_guard<std::mutex> lock(sleep); // so that a worker about to sleep does not miss the job
+		}
+		wake.notify_one();
+	}
+
+	void wait(group& g) {
+		unsigned i = self();
+		while (g.pending.load() != 0) {
+			if (!execute(i)) std::this_thread::yield();
+		}
+	}
+
+private:
+	struct job {
+		std::function<void()> run;
+		group* owner;
+	};
+	struct queue {
+		std::mutex lock;
+		std::deque<job> jobs;
+	};
+
+	/**
+	 * the index of the queue owned by the calling thread
+	 */
+	unsigned self() const {
+		const identity& id = whoami();
+		return id.pool == this ? id.index : 0;
+	}
+	struct identity {
+		const worker_pool* pool;
+		unsigned index;
+	};
+	static identity& whoami() {
+		static thread_local identity id = { nullptr, 0 };
+		return id;
+	}
+
+	/**
+	 * run a job from the own queue, or steal one from the others, return false if there is none
+	 */
+	bool execute(unsigned i) {
+		job next;
+		if (!take(queues[i], next, false)) {
+			bool stolen = false;
+			for (unsigned k = 1; k < queues.size() && !stolen; k++)
+				stolen = take(queues[(i + k) % queues.size()], next, true);
+			if (!stolen) return false;
+		}
+		queued--;
+		next.run();
+		next.owner->pending--;
+		return true;
+	}
+	static bool take(queue& q, job& next, bool steal) {
+		std::lock_guard<std::mutex> lock(q.lock);
+		if (q.jobs.empty()) return false;
+		if (steal) {
+			next = std::move(q.jobs.front());
+			q.jobs.pop_front();
+		} else {
+			next = std::move(q.jobs.back());
+			q.jobs.pop_back();
+		}
+		return true;
+	}
+
+	void work(unsigned i) {
+		whoami() = { this, i };
+		while (true) {
+			if (execute(i)) continue;
+			std::unique_lock<std::mutex> lock(sleep);
+			wake.wait(lock, [this]() { return stop || queued.load() != 0; });
+			if (stop) return;
+		}
+	}
+
+	std::vector<queue> queues;
+	std::vector<std::thread> workers;
+	std::atomic<size_t> queued;
+	std::mutex sleep;
+	std::condition_variable wake;
+	bool stop;
+};
@@ -0,0 +1,126 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * profile.h: Access instrumentation of n-tuple networks
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <cctype>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+
+/**
+ * counters of the lookups of each table, and of the time spent on the evaluations
+ * the counters are cumulative and updated with relaxed atomics, since the search may run on multiple threads
+ *
+ * the agents only count when compiled with -DPROFILE_NETWORK (see "make profile"), and nothing is left otherwise
+ */
+class network_profile {
+public:
+	struct table {
+		uint64_t hits; // the lookups of the table
+		uint64_t zeros; // the lookups hitting an entry that is still zero, i.e., never trained
+		uint64_t distinct; // the entries ever looked up
+		size_t size;
+		std::vector<uint64_t> touched; // the bitmap of the entries ever looked up
+	};
+	struct latency {
+		uint64_t calls;
+		uint64_t states; // the afterstates evaluated by the calls
+		uint64_t nanos;
+	};
+
+	/**
+	 * accumulate the time of a scope into a latency counter
+	 */
+	class timer {
+	public:
+		timer(latency& into, size_t states = 1) : into(into), states(states), start(clock::now()) {}
+		~timer() {
+			uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+			__atomic_fetch_add(&into.calls, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&into.states, states, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&into.nanos, nanos, __ATOMIC_RELAXED);
+		}
+	private:
+		typedef std::chrono::steady_clock clock;
+		latency& into;
+		size_t states;
+		clock::time_point start;
+	};
+
+public:
+	/**
+	 * the tables to be profiled given by their comma-separated sizes, and the summary is shown every given episodes
+	 */
+	network_profile(const std::string& sizes, size_t every = 1000) : value(), expectation(), every(every ?: 1), episodes(0) {
+		std::string res = sizes;
+		for (char& ch : res)
+			if (!std::isdigit(ch)) ch = ' ';
+		std::stringstream in(res);
+		for (size_t size; in >> size; )
+			tables.push_back({ 0, 0, 0, size, std::vector<uint64_t>((size + 63) / 64) });
+	}
+
+	/**
+	 * count an episode, and show the summary every given episodes
+	 */
+	void close_episode() {
+		size_t n = __atomic_add_fetch(&episodes, 1, __ATOMIC_RELAXED);
+		if (n % every == 0) show(n);
+	}
+
+	void hit(unsigned k, size_t i, bool zero) {
+		table& t = tables[k];
+		__atomic_fetch_add(&t.hits, 1, __ATOMIC_RELAXED);
+		if (zero) __atomic_fetch_add(&t.zeros, 1, __ATOMIC_RELAXED);
+		uint64_t bit = uint64_t(1) << (i % 64);
+		if (!(t.touched[i / 64] & bit) && !(__atomic_fetch_or(&t.touched[i / 64], bit, __ATOMIC_RELAXED) & bit))
+			__atomic_fetch_add(&t.distinct, 1, __ATOMIC_RELAXED);
+	}
+
+	/**
+	 * the format is
+	 * profile 1000    value = 85 ns/state (12 states/call), expectation = 6154 ns/call
+	 *         #0      hits = 301574176, distinct = 1305843 (7.8%), zero = 0.4%
+	 *         ...
+	 *
+	 * where
+	 * '1000': the episodes played so far, i.e., n
+	 * 'value = 85 ns/state (12 states/call)': the time of valueEstimate per afterstate, and the afterstates per call
+	 * 'expectation = 6154 ns/call': the time of expectationEstimate per call at the root, including the nested evaluations
+	 * 'distinct = 1305843 (7.8%)': the entries of table #0 ever looked up, and their share of the table
+	 * 'zero = 0.4%': the share of the lookups hitting entries that are still zero
+	 */
+	void show(size_t n, std::ostream& out = std::cerr) const {
+		std::ios ff(nullptr);
+		ff.copyfmt(out);
+		out << std::fixed << std::setprecision(0);
+		out << "profile " << n << "\t";
+		out << "value = " << (value.nanos / std::max(double(value.states), 1.0)) << " ns/state ";
+		out << "(" << (value.states / std::max(double(value.calls), 1.0)) << " states/call), ";
+		out << "expectation = " << (expectation.nanos / std::max(double(expectation.calls), 1.0)) << " ns/call" << std::endl;
+		out << std::setprecision(1);
+		for (size_t k = 0; k < tables.size(); k++) {
+			const table& t = tables[k];
+			out << "\t#" << k << "\t";
+			out << "hits = " << t.hits << ", ";
+			out << "distinct = " << t.distinct << " (" << (t.distinct * 100.0 / std::max(double(t.size), 1.0)) << "%), ";
+			out << "zero = " << (t.zeros * 100.0 / std::max(double(t.hits), 1.0)) << "%" << std::endl;
+		}
+		out.copyfmt(ff);
+	}
+
+public:
+	std::vector<table> tables;
+	latency value; // valueEstimate
+	latency expectation; // expectationEstimate at the root
+	size_t every;
+	size_t episodes;
+};
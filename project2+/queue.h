@@ -0,0 +1,67 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * queue.h: Lock-free multi-producer single-consumer queue
+ */
+
+#pragma once
+#include <atomic>
+#include <thread>
+#include <utility>
+
+/**
+ * unbounded linked queue, where producers only exchange the head, and the single consumer only follows the tail
+ * i.e., push never blocks other producers and pop never blocks producers
+ *
+ * the tail is always a consumed node, whose successor holds the front value
+ * if the capacity is not 0, producers yield while the queue is full, so that fast producers cannot exhaust the memory
+ */
+template<typename T>
+class mpsc_queue {
+public:
+	mpsc_queue(size_t capacity = 0) : head(new node()), tail(head.load()), count(0), capacity(capacity) {}
+	~mpsc_queue() {
+		for (node* n = tail; n; ) {
+			node* next = n->next.load();
+			delete n;
+			n = next;
+		}
+	}
+	mpsc_queue(const mpsc_queue&) = delete;
+	mpsc_queue& operator =(const mpsc_queue&) = delete;
+
+	void push(T&& value) {
+		while (capacity && count.load() >= capacity) std::this_thread::yield();
+		count++;
+		node* n = new node(std::move(value));
+		node* prev = head.exchange(n);
+		prev->next.store(n, std::memory_order_release); // the queue is cut between the exchange and the store
+	}
+
+	/**
+	 * only called by the consumer, return false if the queue is empty (or the latest push is not yet linked)
+	 */
+	bool pop(T& value) {
+		node* next = tail->next.load(std::memory_order_acquire);
+		if (next == nullptr) return false;
+		value = std::move(next->value);
+		delete tail;
+		tail = next;
+		count--;
+		return true;
+	}
+
+	size_t size() const { return count.load(); }
+
+private:
+	struct node {
+		node() : next(nullptr) {}
+		node(T&& value) : value(std::move(value)), next(nullptr) {}
+		T value;
+		std::atomic<node*> next;
+	};
+
+	std::atomic<node*> head;
+	node* tail;
+	std::atomic<size_t> count;
+	size_t capacity;
+};
@@ -0,0 +1,47 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * replay.h: Preallocated ring buffer for the steps of episodes
+ */
+
+#pragma once
+#include <cstddef>
+#include <vector>
+
+/**
+ * ring buffer whose slots are allocated once, and reused by later episodes
+ * the capacity is rounded up to a power of two,
+ * and if an episode is longer than the capacity, its earliest steps are overwritten
+ */
+template<typename T>
+class ring_buffer {
+public:
+	ring_buffer(size_t capacity = 0) : slots(round(capacity)), head(0), count(0) {}
+
+	/**
+	 * append a slot at the back, whose content is left from an earlier use and should be overwritten
+	 */
+	T& push() {
+		T& slot = slots[(head + count) & (slots.size() - 1)];
+		if (count < slots.size()) count++;
+		else head = (head + 1) & (slots.size() - 1);
+		return slot;
+	}
+	void clear() { head = 0; count = 0; }
+
+	T& operator[] (size_t i) { return slots[(head + i) & (slots.size() - 1)]; }
+	const T& operator[] (size_t i) const { return slots[(head + i) & (slots.size() - 1)]; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	size_t capacity() const { return slots.size(); }
+
+private:
+	static size_t round(size_t capacity) {
+		size_t n = 1;
+		while (n < capacity) n *= 2;
+		return n;
+	}
+
+	std::vector<T> slots;
+	size_t head;
+	size_t count;
+};
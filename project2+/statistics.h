@@ -116,6 +116,15 @@ public:
 		if (count % block == 0) show();
 	}
 
+	/**
+	 * append an episode played outside, e.g., by another thread
+	 */
+	void add_episode(episode&& ep) {
+		if (count++ >= limit) data.pop_front();
+		data.push_back(std::move(ep));
+		if (count % block == 0) show();
+	}
+
 	episode& at(size_t i) {
 		return data.at(i);
 	}
@@ -129,6 +138,26 @@ public:
 		return count;
 	}
 
+	/**
+	 * the counter and the kept episodes (the last 'limit' ones), so that a resumed run continues the same reports and records
+	 */
+	void save_state(std::ostream& out) const {
+		out << count << " " << data.size() << std::endl;
+		for (const episode& rec : data) out << rec << std::endl;
+	}
+	void load_state(std::istream& in) {
+		size_t num = 0;
+		in >> count >> num;
+		in.ignore();
+		data.clear();
+		for (std::string line; num-- && std::getline(in, line); ) {
+			data.emplace_back();
+			std::stringstream(line) >> data.back();
+		}
+		while (data.size() > limit) data.pop_front();
+		total = std::max(total, count);
+	}
+
 	friend std::ostream& operator <<(std::ostream& out, const statistics& stat) {
 		for (const episode& rec : stat.data) out << rec << std::endl;
 		return out;
@@ -11,20 +11,31 @@
 #include <fstream>
 #include <iterator>
 #include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <algorithm>
 #include "board.h"
 #include "action.h"
 #include "agent.h"
 #include "episode.h"
 #include "statistics.h"
+#include "queue.h"
+#include "checkpoint.h"
 
 int main(int argc, const char* argv[]) {
 	std::cout << "Threes! Demo: ";
 	std::copy(argv, argv + argc, std::ostream_iterator<const char*>(std::cout, " "));
 	std::cout << std::endl << std::endl;
 
-	size_t total = 1000, block = 0, limit = 0;
+	size_t total = 1000, block = 0, limit = 0, threads = 1, actors = 0, every = 0;
 	std::string slide_args, place_args;
 	std::string load_path, save_path;
+	std::string checkpoint_path, resume_path;
 	for (int i = 1; i < argc; i++) {
 		std::string arg = argv[i];
 		auto match_arg = [&](std::string flag) -> bool {
@@ -41,6 +52,10 @@ int main(int argc, const char* argv[]) {
 			block = std::stoull(next_opt());
 		} else if (match_arg("limit")) {
 			limit = std::stoull(next_opt());
+		} else if (match_arg("threads")) {
+			threads = std::stoull(next_opt());
+		} else if (match_arg("actors")) {
+			actors = std::stoull(next_opt());
 		} else if (match_arg("slide") || match_arg("play")) {
 			slide_args = next_opt();
 		} else if (match_arg("place") || match_arg("env")) {
@@ -49,6 +64,12 @@ int main(int argc, const char* argv[]) {
 			load_path = next_opt();
 		} else if (match_arg("save")) {
 			save_path = next_opt();
+		} else if (match_arg("checkpoint")) {
+			checkpoint_path = next_opt();
+		} else if (match_arg("every")) {
+			every = std::stoull(next_opt());
+		} else if (match_arg("resume")) {
+			resume_path = next_opt();
 		}
 	}
 
@@ -64,16 +85,45 @@ int main(int argc, const char* argv[]) {
 	//random_slider slide(slide_args);
 	//reward_player slide(slide_args);
 	//twoSteps_player slide(slide_args);
+	//basic_td_agent<tuple4_network> slide(slide_args);
+	//basic_td_agent<canonical<tuple6_network>> slide(slide_args);
+	//basic_td_agent<tuple8_network> slide(slide_args);
 	td_agent slide(slide_args);
 	random_placer place(place_args);
+	typedef decltype(slide) slider; // the type of replicas sharing the tables of slide
+	if (slide.hashed() && (threads > 1 || actors > 0 || checkpoint_path.size() || resume_path.size())) {
+		std::cerr << (threads > 1 ? "--threads" : actors > 0 ? "--actors" : "--checkpoint") << " is not supported with hashed tables (hash)" << std::endl;
+		return -1;
+	}
+	std::vector<std::string> placers; // the states of the placers of the threads, recorded after each of their episodes
 
-	while (!stats.is_finished()) {
-//		std::cerr << "======== Game " << stats.step() << " ========" << std::endl;
-		slide.open_episode("~:" + place.name());
-		place.open_episode(slide.name() + ":~");
+	if (resume_path.size()) {
+		std::stringstream state(checkpoint::restore(resume_path, slide.tables()));
+		slide.load_state(state);
+		place.load_state(state);
+		size_t num = 0;
+		state >> num;
+		state.ignore();
+		placers.resize(num);
+		for (std::string& line : placers) std::getline(state, line);
+		stats.load_state(state);
+	}
+	placers.resize(std::max(placers.size(), std::max(actors, threads > 1 ? threads : 0)));
+	std::unique_ptr<checkpoint> saver(checkpoint_path.size() ? new checkpoint(checkpoint_path) : nullptr);
+	every = every ?: (block ?: 1000);
+	size_t saved = stats.step(); // the number of episodes in the latest checkpoint
+	auto save_checkpoint = [&]() {
+		std::stringstream state;
+		slide.save_state(state);
+		place.save_state(state);
+		state << placers.size() << std::endl;
+		for (const std::string& line : placers) state << line << std::endl;
+		stats.save_state(state);
+		saver->save(slide.tables(), state.str());
+		saved = stats.step();
+	};
 
-		stats.open_episode(slide.name() + ":" + place.name());
-		episode& game = stats.back();
+	auto play = [](agent& slide, agent& place, episode& game) {
 		while (true) {
 			agent& who = game.take_turns(slide, place);
 			action move = who.take_action(game.state());
@@ -81,12 +131,107 @@ int main(int argc, const char* argv[]) {
 			if (game.apply_action(move) != true) break;
 			if (who.check_for_win(game.state())) break;
 		}
+	};
+
+	std::mutex report;
+	std::atomic<size_t> claim(stats.step());
+	// count a learned episode of thread t with the state of its placer afterward, and checkpoint at every multiple of every
+	auto record = [&](episode&& game, size_t t, const std::string& placer) {
+		std::lock_guard<std::mutex> lock(report);
+		stats.add_episode(std::move(game));
+		if (!saver) return;
+		placers[t] = placer;
+		if (stats.step() % every == 0) save_checkpoint();
+	};
+	// play episodes on a replica of slide in another thread, and finish each of them by the given function
+	auto act = [&](size_t t, std::function<void(slider&, episode&&, const std::string&, const std::string&)> finish) {
+		slider player(slide);
+		random_placer placer(t ? place_args + " seed=" + std::to_string(std::random_device()()) : place_args);
+		if (placers[t].size()) {
+			std::stringstream state(placers[t]);
+			placer.load_state(state); // continue the tiles of the thread where the resumed run stopped
+		}
+		for (size_t id; (id = ++claim) <= total; ) {
+			player.open_episode("~:" + placer.name());
+			placer.open_episode(player.name() + ":~");
+
+			episode game;
+			game.open_episode(player.name() + ":" + placer.name());
+			play(player, placer, game);
+			agent& win = game.last_turns(player, placer);
+			game.close_episode(win.name());
+			std::string state;
+			if (saver) {
+				std::stringstream out;
+				placer.save_state(out);
+				std::getline(out, state);
+			}
+
+			finish(player, std::move(game), win.name(), state);
+			placer.close_episode(win.name());
+		}
+	};
+
+	if (actors > 0) {
+		// actor/learner pipeline: actors push their episodes to a queue, and only this thread updates the tables of slide
+		// the episodes are counted once learned, so that a checkpoint never includes an episode missing from the tables
+		struct trajectory {
+			std::vector<slider::step> path;
+			episode game;
+			size_t actor;
+			std::string placer;
+		};
+		mpsc_queue<trajectory> episodes(4 * actors);
+		std::atomic<size_t> running(actors);
+		std::vector<std::thread> workers;
+		for (size_t t = 0; t < actors; t++) {
+			workers.emplace_back([&, t]() {
+				act(t, [&](slider& actor, episode&& game, const std::string& win, const std::string& placer) {
+					episodes.push({ actor.trajectory(), std::move(game), t, placer });
+				});
+				running--;
+			});
+		}
+		for (trajectory item; ; ) {
+			bool done = running.load() == 0;
+			if (episodes.pop(item)) {
+				slide.learn(item.path);
+				record(std::move(item.game), item.actor, item.placer);
+			} else if (done) break;
+			else std::this_thread::yield();
+		}
+		for (std::thread& worker : workers) worker.join();
+	} else if (threads > 1) {
+		// Hogwild: each thread plays its own episodes, and updates the shared tables of slide without locks
+		std::vector<std::thread> workers;
+		for (size_t t = 0; t < threads; t++) {
+			workers.emplace_back([&, t]() {
+				act(t, [&](slider& learner, episode&& game, const std::string& win, const std::string& placer) {
+					learner.close_episode(win);
+					record(std::move(game), t, placer);
+				});
+			});
+		}
+		for (std::thread& worker : workers) worker.join();
+	}
+
+	while (!stats.is_finished()) {
+//		std::cerr << "======== Game " << stats.step() << " ========" << std::endl;
+		slide.open_episode("~:" + place.name());
+		place.open_episode(slide.name() + ":~");
+
+		stats.open_episode(slide.name() + ":" + place.name());
+		episode& game = stats.back();
+		play(slide, place, game);
 		agent& win = game.last_turns(slide, place);
 		stats.close_episode(win.name());
 
 		slide.close_episode(win.name());
 		place.close_episode(win.name());
+		if (saver && stats.step() % every == 0) save_checkpoint();
 	}
+	if (saver && stats.step() != saved) save_checkpoint();
+	saver.reset();
 
 	if (save_path.size()) {
 		std::ofstream out(save_path, std::ios::out | std::ios::trunc);
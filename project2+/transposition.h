@@ -0,0 +1,148 @@
+/**
+ * Framework for Threes! and its variants (C++ 11)
+ * transposition.h: Transposition table for expectimax search on packed boards
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <atomic>
+#include <iostream>
+#include <iomanip>
+#include "bitboard.h"
+#include "allocator.h"
+
+/**
+ * fixed-size transposition table of searched node values
+ *
+ * the key combines the tile grid with the attributes (hint, last action, and bag counts),
+ * since the same tiles with a different hint or bag lead to different chance nodes
+ *
+ * entries are grouped into buckets of one cache line, each entry is stored as two 64-bit words,
+ * i.e., (key ^ data) and (data), so that a torn entry written concurrently never matches its key,
+ * and the table can be read without locks
+ *
+ * when a bucket is full, the entry searched least deeply is replaced,
+ * where entries stored before earlier moves (older generations) are considered shallower
+ */
+class transposition {
+public:
+	enum node_type { chance_node = 1, max_node = 2 };
+
+	transposition() : generation(0), probes(0), hits(0), stores(0), replaces(0) {}
+
+	/**
+	 * allocate the table with the given size in MB, rounded down to a power of two buckets
+	 */
+	void resize(size_t mb) {
+		size_t num = 1;
+		while (num * 2 * sizeof(bucket) <= (mb << 20)) num *= 2;
+		table.assign(mb ? num : 0, bucket());
+	}
+	bool empty() const { return table.empty(); }
+	size_t size() const { return table.size() * ways; }
+
+	/**
+	 * advance the generation of stored entries, e.g., before each move
+	 */
+	void age() { generation = (generation + 1) & 0xffu; }
+
+	/**
+	 * look up the value of a node searched at least as deep as the given depth
+	 */
+	bool probe(const bitboard& b, unsigned depth, node_type type, float& value) {
+		probes.fetch_add(1, std::memory_order_relaxed);
+		uint64_t key = hash(b, type);
+		const entry* slot = table[key & (table.size() - 1)].slot;
+		for (unsigned i = 0; i < ways; i++) {
+			uint64_t data = __atomic_load_n(&slot[i].data, __ATOMIC_RELAXED);
+			uint64_t check = __atomic_load_n(&slot[i].check, __ATOMIC_RELAXED);
+			if ((check ^ data) != key || depth_of(data) < depth) continue;
+			value = value_of(data);
+			hits.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+		return false;
+	}
+
+	void store(const bitboard& b, unsigned depth, node_type type, float value) {
+		stores.fetch_add(1, std::memory_order_relaxed);
+		uint64_t key = hash(b, type);
+		entry* slot = table[key & (table.size() - 1)].slot;
+		unsigned victim = 0;
+		bool evict = true;
+		int shallowest = 0x7fffffff;
+		for (unsigned i = 0; i < ways; i++) {
+			uint64_t data = __atomic_load_n(&slot[i].data, __ATOMIC_RELAXED);
+			uint64_t check = __atomic_load_n(&slot[i].check, __ATOMIC_RELAXED);
+			if ((check ^ data) == key) {
+				if (depth_of(data) > depth) return; // keep the deeper result
+				victim = i, evict = false;
+				break;
+			}
+			if (data == 0) { // unused entry
+				victim = i, evict = false;
+				break;
+			}
+			int priority = int(depth_of(data)) - 8 * int((generation - generation_of(data)) & 0xffu);
+			if (priority < shallowest) {
+				shallowest = priority;
+				victim = i;
+			}
+		}
+		if (evict) replaces.fetch_add(1, std::memory_order_relaxed);
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		uint64_t data = uint64_t(bits) | (uint64_t(depth & 0xffu) << 32) | (uint64_t(generation) << 40);
+		__atomic_store_n(&slot[victim].check, key ^ data, __ATOMIC_RELAXED);
+		__atomic_store_n(&slot[victim].data, data, __ATOMIC_RELAXED);
+	}
+
+	/**
+	 * print the hit rate and the replacement count, e.g.,
+	 * tt: 4194304 entries, 1520034 probes, 912020 hits (60.00%), 608014 stores, 10233 replaces
+	 */
+	friend std::ostream& operator <<(std::ostream& out, const transposition& tt) {
+		out << "tt: " << tt.size() << " entries, " << tt.probes << " probes, " << tt.hits << " hits ";
+		out << "(" << std::fixed << std::setprecision(2) << (tt.probes ? 100.0 * tt.hits / tt.probes : 0) << "%), ";
+		out << tt.stores << " stores, " << tt.replaces << " replaces";
+		return out;
+	}
+
+private:
+	struct entry {
+		uint64_t check; // key ^ data
+		uint64_t data; // (generation:8-bit) (depth:8-bit) (value:32-bit float)
+	};
+	static constexpr unsigned ways = 4;
+	struct alignas(64) bucket {
+		entry slot[ways];
+		bucket() { std::memset(slot, 0, sizeof(slot)); }
+	};
+
+	static uint64_t hash(const bitboard& b, node_type type) {
+		uint64_t h = b.raw() ^ ((uint64_t(b.info()) << 8 | type) * 0x9e3779b97f4a7c15ull);
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ull;
+		h ^= h >> 33;
+		return h;
+	}
+	static float value_of(uint64_t data) {
+		uint32_t bits = uint32_t(data);
+		float value;
+		std::memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+	static unsigned depth_of(uint64_t data) { return (data >> 32) & 0xffu; }
+	static unsigned generation_of(uint64_t data) { return (data >> 40) & 0xffu; }
+
+	std::vector<bucket, table_allocator<bucket>> table;
+	unsigned generation;
+	std::atomic<uint64_t> probes;
+	std::atomic<uint64_t> hits;
+	std::atomic<uint64_t> stores;
+	std::atomic<uint64_t> replaces;
+};
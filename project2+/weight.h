@@ -11,6 +11,58 @@
 #include <iostream>
 #include <vector>
 #include <utility>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cstdint>
+#include <cassert>
+#include <memory>
+#include "allocator.h"
+
+/**
+ * contiguous entries of a lookup table, either owned by the table (allocated by table_allocator),
+ * or viewed from a region shared with other tables, e.g., a memory-mapped weight file
+ */
+template<typename T>
+class storage {
+public:
+	storage() : base(nullptr), length(0) {}
+	storage(size_t len) : owned(len), base(owned.data()), length(len) {}
+	storage(T* data, size_t len, const std::shared_ptr<void>& region) : base(data), length(len), region(region) {}
+	storage(storage&& s) : owned(std::move(s.owned)), base(s.base), length(s.length), region(std::move(s.region)) {
+		s.base = nullptr;
+		s.length = 0;
+	}
+	storage(const storage& s) : owned(s.owned), base(s.region ? s.base : owned.data()), length(s.length), region(s.region) {}
+
+	storage& operator =(storage s) {
+		std::swap(owned, s.owned);
+		std::swap(base, s.base);
+		std::swap(length, s.length);
+		std::swap(region, s.region);
+		return *this;
+	}
+	T& operator[] (size_t i) { return base[i]; }
+	const T& operator[] (size_t i) const { return base[i]; }
+	T* data() { return base; }
+	const T* data() const { return base; }
+	size_t size() const { return length; }
+	bool shared() const { return region != nullptr; }
+
+	void resize(size_t len) {
+		if (shared()) owned.assign(base, base + std::min(len, length));
+		owned.resize(len);
+		base = owned.data();
+		length = len;
+		region.reset();
+	}
+
+private:
+	std::vector<T, table_allocator<T>> owned;
+	T* base;
+	size_t length;
+	std::shared_ptr<void> region;
+};
 
 class weight {
 public:
@@ -19,6 +71,7 @@ public:
 public:
 	weight() {}
 	weight(size_t len) : value(len) {}
+	weight(type* data, size_t len, const std::shared_ptr<void>& region) : value(data, len, region) {}
 	weight(weight&& f) : value(std::move(f.value)) {}
 	weight(const weight& f) = default;
 
@@ -26,6 +79,10 @@ public:
 	type& operator[] (size_t i) { return value[i]; }
 	const type& operator[] (size_t i) const { return value[i]; }
 	size_t size() const { return value.size(); }
+	type* data() { return value.data(); }
+	const type* data() const { return value.data(); }
+	type factor() const { return 1; }
+	void prefetch(size_t i) const { __builtin_prefetch(value.data() + i); }
 
 public:
 	friend std::ostream& operator <<(std::ostream& out, const weight& w) {
@@ -45,5 +102,246 @@ public:
 	}
 
 protected:
-	std::vector<type> value;
+	storage<type> value;
+};
+
+/**
+ * quantized lookup table for inference only
+ * each entry stores round(w / scale) of the float weight w as an integer of type q,
+ * where the scale of a table is chosen to fit its largest absolute weight
+ */
+template<typename q>
+class qweight {
+public:
+	typedef q type;
+
+public:
+	qweight() : scale(0) {}
+	qweight(type* data, size_t len, weight::type scale, const std::shared_ptr<void>& region) : value(data, len, region), scale(scale) {}
+	qweight(const weight& w) : value(w.size()), scale(0) {
+		weight::type peak = 0;
+		for (size_t i = 0; i < w.size(); i++) peak = std::max(peak, std::abs(w[i]));
+		scale = peak / std::numeric_limits<type>::max();
+		if (scale == 0) return;
+		for (size_t i = 0; i < w.size(); i++) value[i] = type(std::lround(w[i] / scale));
+	}
+	qweight(qweight&& f) : value(std::move(f.value)), scale(f.scale) {}
+	qweight(const qweight& f) = default;
+
+	qweight& operator =(const qweight& f) = default;
+	weight::type operator[] (size_t i) const { return value[i] * scale; }
+	size_t size() const { return value.size(); }
+	const type* data() const { return value.data(); }
+	weight::type factor() const { return scale; }
+	void prefetch(size_t i) const { __builtin_prefetch(value.data() + i); }
+
+public:
+	friend std::ostream& operator <<(std::ostream& out, const qweight& w) {
+		auto& value = w.value;
+		uint64_t size = value.size();
+		out.write(reinterpret_cast<const char*>(&size), sizeof(uint64_t));
+		out.write(reinterpret_cast<const char*>(&w.scale), sizeof(weight::type));
+		out.write(reinterpret_cast<const char*>(value.data()), sizeof(type) * size);
+		return out;
+	}
+	friend std::istream& operator >>(std::istream& in, qweight& w) {
+		auto& value = w.value;
+		uint64_t size = 0;
+		in.read(reinterpret_cast<char*>(&size), sizeof(uint64_t));
+		in.read(reinterpret_cast<char*>(&w.scale), sizeof(weight::type));
+		value.resize(size);
+		in.read(reinterpret_cast<char*>(value.data()), sizeof(type) * size);
+		return in;
+	}
+
+protected:
+	storage<type> value;
+	weight::type scale;
+};
+
+/**
+ * hashed lookup table for large patterns, e.g., 7- or 8-tuples whose dense tables do not fit in memory,
+ * where only the entries adjusted by learning are materialized, and the others read as 0
+ *
+ * the entries are kept in an open-addressing table of a fixed capacity with linear probing,
+ * once the table is half full, the least visited entries are evicted until it is 3/8 full (short probes),
+ * and the visits of the remaining entries are halved, so that entries no longer visited age out
+ *
+ * materializing an entry may rehash the others, i.e., the table cannot be shared by threads
+ */
+class hash_weight {
+public:
+	struct slot {
+		uint32_t key;
+		weight::type value;
+		uint32_t visits; // the number of adjustments, or 0 if the slot is empty
+	};
+	typedef slot type;
+
+public:
+	hash_weight() : length(0), count(0) {}
+	hash_weight(size_t len, size_t capacity) : slots(round(capacity)), length(len), count(0) {}
+	hash_weight(hash_weight&& f) = default;
+	hash_weight(const hash_weight& f) = default;
+
+	hash_weight& operator =(const hash_weight& f) = default;
+	weight::type operator[] (size_t i) const {
+		for (size_t s = home(i); slots[s].visits; s = next(s))
+			if (slots[s].key == i) return slots[s].value;
+		return 0;
+	}
+	weight::type& operator[] (size_t i) {
+		slot& e = locate(i);
+		e.visits += (e.visits != std::numeric_limits<uint32_t>::max());
+		return e.value;
+	}
+	size_t size() const { return length; }
+	size_t capacity() const { return slots.size(); }
+	size_t entries() const { return count; }
+	weight::type factor() const { return 1; }
+	void prefetch(size_t i) const { __builtin_prefetch(slots.data() + home(i)); }
+
+public:
+	/**
+	 * the number of entries, the capacity, the number of materialized entries, and then the materialized slots
+	 * a table with a capacity keeps it when loaded, otherwise the saved capacity is used
+	 */
+	friend std::ostream& operator <<(std::ostream& out, const hash_weight& w) {
+		uint64_t size = w.length, capacity = w.slots.size(), count = w.count;
+		out.write(reinterpret_cast<const char*>(&size), sizeof(uint64_t));
+		out.write(reinterpret_cast<const char*>(&capacity), sizeof(uint64_t));
+		out.write(reinterpret_cast<const char*>(&count), sizeof(uint64_t));
+		for (size_t s = 0; s < w.slots.size(); s++)
+			if (w.slots[s].visits) out.write(reinterpret_cast<const char*>(&w.slots[s]), sizeof(slot));
+		return out;
+	}
+	friend std::istream& operator >>(std::istream& in, hash_weight& w) {
+		uint64_t size = 0, capacity = 0, count = 0;
+		in.read(reinterpret_cast<char*>(&size), sizeof(uint64_t));
+		in.read(reinterpret_cast<char*>(&capacity), sizeof(uint64_t));
+		in.read(reinterpret_cast<char*>(&count), sizeof(uint64_t));
+		w = hash_weight(size, w.capacity() ? w.capacity() : capacity);
+		for (slot e; count-- && in.read(reinterpret_cast<char*>(&e), sizeof(slot)); ) {
+			slot& entry = w.locate(e.key);
+			entry.value = e.value;
+			entry.visits = std::max(e.visits, 1u);
+		}
+		return in;
+	}
+
+private:
+	/**
+	 * the capacity is rounded down to a power of two, so that it never exceeds the memory given
+	 */
+	static size_t round(size_t capacity) {
+		size_t n = 1024;
+		while (n * 2 <= capacity) n *= 2;
+		return n;
+	}
+	/**
+	 * the low bits of the folded product, so that the slot orders of tables in different capacities are unrelated,
+	 * e.g., the entries of a larger table are not loaded into a few runs of a smaller table
+	 */
+	size_t home(size_t i) const {
+		uint64_t h = uint64_t(i) * 0x9e3779b97f4a7c15ull;
+		return (h ^ (h >> 32)) & (slots.size() - 1);
+	}
+	size_t next(size_t s) const { return (s + 1) & (slots.size() - 1); }
+
+	/**
+	 * find the slot of an entry, or materialize it with value 0 and visits 0 (to be visited by the caller)
+	 */
+	slot& locate(size_t i) {
+		size_t s = home(i);
+		for (; slots[s].visits; s = next(s))
+			if (slots[s].key == i) return slots[s];
+		if (count + 1 > slots.size() / 2) {
+			evict();
+			for (s = home(i); slots[s].visits; s = next(s));
+		}
+		slots[s] = { uint32_t(i), 0, 0 };
+		count++;
+		return slots[s];
+	}
+
+	/**
+	 * the entries are ranked by the bit length of their visits, and evicted from the lowest rank
+	 * the remaining entries are rehashed in place, starting from a slot that is empty before the eviction,
+	 * so that no run of slots crosses the start and every run is rehashed in order
+	 */
+	void evict() {
+		size_t start = 0;
+		while (slots[start].visits) start++;
+		size_t rank[33] = { 0 };
+		for (size_t s = 0; s < slots.size(); s++)
+			if (slots[s].visits) rank[32 - __builtin_clz(slots[s].visits)]++;
+		size_t quota = count - slots.size() / 8 * 3, below = 0;
+		unsigned level = 1;
+		while (below + rank[level] < quota) below += rank[level++];
+		size_t partial = quota - below, spread = 0; // the entries evicted from the level, spread evenly over the slots
+		for (size_t s = 0; s < slots.size(); s++) {
+			slot& e = slots[s];
+			if (!e.visits) continue;
+			unsigned r = 32 - __builtin_clz(e.visits);
+			if (r == level && (spread += partial) >= rank[level]) spread -= rank[level], r = 0;
+			if (r < level) {
+				e.visits = 0;
+				count--;
+			} else {
+				e.visits = (e.visits + 1) / 2;
+			}
+		}
+		for (size_t n = 0, s = start; n < slots.size(); n++, s = next(s)) {
+			if (!slots[s].visits) continue;
+			slot e = slots[s];
+			slots[s].visits = 0;
+			size_t t = home(e.key);
+			while (slots[t].visits) t = next(t);
+			slots[t] = e;
+		}
+		assert(reachable()); // a stranded entry would be read as 0 and materialized again
+	}
+
+	/**
+	 * whether every entry is found by probing from its home slot, i.e., no empty slot lies between them
+	 * the scan is over the whole table, and is only checked in builds without NDEBUG
+	 */
+	bool reachable() const {
+		for (size_t s = 0; s < slots.size(); s++) {
+			if (!slots[s].visits) continue;
+			size_t t = home(slots[s].key);
+			while (t != s && slots[t].visits) t = next(t);
+			if (t != s) return false;
+		}
+		return true;
+	}
+
+	storage<slot> slots;
+	size_t length;
+	size_t count;
+};
+
+/**
+ * self-describing layout of memory-mapped weight files
+ *
+ * the file starts with a header, followed by one entry per table,
+ * and the elements of each table start at an aligned offset of the file
+ * so that a table can be viewed directly from the mapped region
+ */
+struct weight_header {
+	uint32_t signature; // "TCGW"
+	uint32_t version;
+	uint32_t count; // number of tables
+	uint32_t element; // element type, i.e., 0 for float, 16 or 8 for quantized tables
+	uint64_t align; // alignment of table elements
+	uint64_t reserved;
+
+	struct entry {
+		uint64_t offset; // offset of the first element from the beginning of the file
+		uint64_t size; // number of elements
+		float scale; // scale of quantized elements, or 1 for float
+		uint32_t reserved;
+	};
+
+	static constexpr uint32_t magic() { return 0x57474354u; }
 };